@@ -24,28 +24,66 @@ struct idma_ctrl {
 	dma_addr_t	period;
 	dma_addr_t	periodsz;
 	u32 sz;
+	dma_addr_t	next;		/* period queued in the Next registers */
+	u32 next_sz;
+	u32 cfg;			/* burst sizes for the stream's frames */
 	void		*token;
 	void		(*cb)(void *dt, int bytes_xfer);
 	int dma_irq;
 	dma_addr_t fifo_base;
 	void __iomem *dma_base;
+	u64 formats;			/* the ones the i2s fabric was built with */
+
+	/* the module parameters, or the i2s node's properties */
+	unsigned int buffer_bytes;
+	unsigned int period_bytes_min;
+	unsigned int periods_max;
+	unsigned int fifo_bytes;
 };
 
 
-static int dma_irq;
-static dma_addr_t fifo_base;
-static void __iomem *dma_base;
-static irqreturn_t idma_irq_hanlder(int irqno, void *dev_id);
-static int preallocate_idma_buffer(struct snd_pcm *pcm, int stream);
+// one engine and one playback stream, set up at probe
+static struct idma_ctrl idma;
 
 #define debug_log trace_printk
 
 #define ST_RUNNING		(1<<0)
 #define ST_OPENED		(1<<1)
 
-#define MAX_IDMA_PERIOD (64 * 1024)
-#define MAX_IDMA_BUFFER (64 * 1024)
+#define MAX_IDMA_BUFFER (16 * 1024 * 1024)
+#define MAX_IDMA_PERIODS 1024
+#define IDMA_BURST 16
+#define IDMA_BURST_MAX 64
+
+/*
+ * Buffer and period limits. The module parameters are the defaults, the
+ * mx,buffer-bytes, mx,period-bytes-min and mx,periods-max properties of
+ * the i2s node override them in struct idma_ctrl, the parameters always
+ * show the defaults. The buffer is preallocated at buffer_bytes.
+ */
+static unsigned int buffer_bytes = 64 * 1024;
+module_param(buffer_bytes, uint, 0444);
+MODULE_PARM_DESC(buffer_bytes, "size of the dma buffer, up to 16 MiB");
+
+static unsigned int period_bytes_min = PAGE_SIZE;
+module_param(period_bytes_min, uint, 0444);
+MODULE_PARM_DESC(period_bytes_min, "smallest period, a multiple of 16 bytes");
+
+static unsigned int periods_max = MAX_IDMA_PERIODS;
+module_param(periods_max, uint, 0444);
+MODULE_PARM_DESC(periods_max, "most periods in the buffer, up to 1024");
+
+/*
+ * What plays after the engine has read a sample, for .delay: the i2s fifo,
+ * mx,fifo-bytes overrides it. The codec adds its own through its dai.
+ */
+#define IDMA_FIFO_BYTES 64
+
+static unsigned int fifo_bytes = IDMA_FIFO_BYTES;
+module_param(fifo_bytes, uint, 0444);
+MODULE_PARM_DESC(fifo_bytes, "depth of the i2s tx fifo");
 
+// the limits above and the fabric's formats are filled in at open
 static const struct snd_pcm_hardware idma_hardware = {
 	.info =  SNDRV_PCM_INFO_INTERLEAVED |
 		    /*SNDRV_PCM_INFO_NONINTERLEAVED |*/
@@ -55,12 +93,10 @@ static const struct snd_pcm_hardware idma_hardware = {
 		    SNDRV_PCM_INFO_PAUSE |
 		    SNDRV_PCM_INFO_RESUME,
 		    
-	.formats = SNDRV_PCM_FMTBIT_S16_LE,
-	.buffer_bytes_max = MAX_IDMA_BUFFER,
-	.period_bytes_min = PAGE_SIZE,
-	.period_bytes_max = MAX_IDMA_PERIOD,
+	.formats = SNDRV_PCM_FMTBIT_S16_LE |
+		   SNDRV_PCM_FMTBIT_S24_LE |
+		   SNDRV_PCM_FMTBIT_S32_LE,
 	.periods_min = 1,
-	.periods_max = 4,
 };
 
 
@@ -71,8 +107,38 @@ static const struct snd_pcm_hardware idma_hardware = {
 #define DMA_CFG_REG_OFFSET 0x4
 #define DMA_EXE_BYTES_OFFSET 0x108
 
+#define DMA_CFG_REPEAT (1 << 2)
+#define DMA_CTR_DONE (1 << 30)
+
 
 
+// the period after prtd->next, wrapping at the end of the buffer
+static void idma_next_period(struct idma_ctrl *prtd)
+{
+	prtd->next += prtd->next_sz;
+	if (prtd->next >= prtd->end)
+		prtd->next = prtd->start;
+
+	if (prtd->next + prtd->period > prtd->end)
+		prtd->next_sz = prtd->end - prtd->next;
+	else
+		prtd->next_sz = prtd->period;
+}
+
+// the engine takes the Next registers over when the running period is done
+static void idma_queue_next(struct idma_ctrl *prtd)
+{
+	writel(prtd->next_sz, prtd->dma_base + DMA_LEN_REG_OFFSET);
+	writeq(prtd->next, prtd->dma_base + DMA_SRC_REG_OFFSET);
+}
+
+/*
+ * With DMA_CFG_REPEAT the engine reloads Exec from the Next registers as
+ * soon as a period is done and goes on by itself, so the following period
+ * is queued right after the start and then from each done interrupt. The
+ * fifo never waits on the interrupt latency, that only has to be shorter
+ * than a period.
+ */
 static void spdif_start_transfer(struct idma_ctrl *prtd,
 	struct snd_pcm_substream *substream)
 {
@@ -83,12 +149,14 @@ static void spdif_start_transfer(struct idma_ctrl *prtd,
 	if(prtd->pos >= prtd->end)
 		prtd->pos = prtd->start;
 		
-	if(prtd->pos + prtd->period > prtd->end)
+	// after a pause pos is inside a period, the first transfer ends with it
+	count = prtd->period - (prtd->pos - prtd->start) % prtd->period;
+	if(prtd->pos + count > prtd->end)
 		count = prtd->end - prtd->pos;
-	else
-		count = prtd->period;
 
 	prtd->sz = count;
+	prtd->next = prtd->pos;
+	prtd->next_sz = count;
 
 	
 	debug_log("pos 0x%llx, count %d\n",prtd->pos,count);
@@ -112,32 +180,31 @@ static void spdif_start_transfer(struct idma_ctrl *prtd,
 	
 	// set dest
 	writel(prtd->fifo_base, prtd->dma_base + DMA_DEST_REG_OFFSET);
-	// set dma burst to 16 bytes
-	writel(0x44000008, prtd->dma_base + DMA_CFG_REG_OFFSET);
+	// set the dma burst hw_params chose, reload from Next when done
+	writel(prtd->cfg | DMA_CFG_REPEAT, prtd->dma_base + DMA_CFG_REG_OFFSET);
 	// enable done irq and start
 	writel(3 | (1 << 14), prtd->dma_base + DMA_CTR_REG_OFFSET);
 
-	
+	// run copied Next into Exec, queue the second period already
+	idma_next_period(prtd);
+	idma_queue_next(prtd);
 }
 
 
+/*
+ * The buffer comes from dma_alloc_coherent, so it is mapped the way the
+ * dma api made it, with the same attributes the kernel mapping has. The
+ * application then writes straight into the ring the engine reads.
+ */
 static int idma_mmap(struct snd_soc_component *component,
 		     struct snd_pcm_substream *substream,
 	struct vm_area_struct *vma)
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
-	unsigned long size, offset;
-	int ret;
-
-	/* From snd_pcm_lib_mmap_iomem */
-	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-	size = vma->vm_end - vma->vm_start;
-	offset = vma->vm_pgoff << PAGE_SHIFT;
-	ret = io_remap_pfn_range(vma, vma->vm_start,
-			(runtime->dma_addr + offset) >> PAGE_SHIFT,
-			size, vma->vm_page_prot);
 
-	return ret;
+	return dma_mmap_coherent(substream->dma_buffer.dev.dev, vma,
+				 runtime->dma_area, runtime->dma_addr,
+				 runtime->dma_bytes);
 }
 
 
@@ -146,27 +213,28 @@ static int idma_hw_params(struct snd_soc_component *component,struct snd_pcm_sub
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct idma_ctrl *prtd = substream->runtime->private_data;
+	unsigned int frame, burst;
 
-	/* copy the dma info into runtime management */
-	snd_pcm_set_runtime_buffer(substream, &substream->dma_buffer);
-	/* get the max dma buffer size */
-	runtime->dma_bytes = params_buffer_bytes(params);
-
+	/* the managed buffer is already set up for the runtime */
 	prtd->start = prtd->pos = runtime->dma_addr;
 	prtd->period = params_period_bytes(params);
 	prtd->end = runtime->dma_addr + runtime->dma_bytes;
 
+	/*
+	 * Wider frames, 32 bit samples and tdm, move in bursts of up to 64
+	 * bytes. Periods are whole frames and a multiple of IDMA_BURST, so
+	 * the largest power of two in a frame divides every period.
+	 */
+	frame = params_channels(params) * params_physical_width(params) / 8;
+	burst = clamp_t(unsigned int, frame & -frame, IDMA_BURST, IDMA_BURST_MAX);
+	// read and write transaction size, log2 bytes, and the order bit
+	prtd->cfg = (ilog2(burst) << 28) | (ilog2(burst) << 24) | 0x8;
+
 	debug_log("idma_hw_params: runtime period %ld, dma addr 0x%llx, dma byte 0x%lx\n",prtd->period, \
 			runtime->dma_addr,runtime->dma_bytes);
 	
 	return 0;
 }
-static int idma_hw_free(struct snd_soc_component *component,struct snd_pcm_substream *substream)
-{
-	snd_pcm_set_runtime_buffer(substream, NULL);
-
-	return 0;
-}
 static int idma_prepare(struct snd_soc_component *component,struct snd_pcm_substream *substream)
 {
 
@@ -180,32 +248,78 @@ static int idma_prepare(struct snd_soc_component *component,struct snd_pcm_subst
 
 
 
+/*
+ * Where the engine reads, as an offset in the buffer, called with
+ * prtd->lock held while it runs.
+ */
+static unsigned int idma_hw_offset(struct idma_ctrl *prtd)
+{
+	unsigned int byte_offset, count;
+	dma_addr_t pos;
+	u32 ctr, sz;
+
+	/*
+	 * At the end of a period Exec reloads from Next before the done
+	 * interrupt moves pos on, the done bit tells which period the count
+	 * is of. Read again if the reload came in between.
+	 */
+	do {
+		ctr = readl(prtd->dma_base + DMA_CTR_REG_OFFSET);
+		count = readl(prtd->dma_base + DMA_EXE_BYTES_OFFSET);
+	} while ((readl(prtd->dma_base + DMA_CTR_REG_OFFSET) ^ ctr) & DMA_CTR_DONE);
+
+	if (ctr & DMA_CTR_DONE) {
+		pos = prtd->next;
+		sz = prtd->next_sz;
+	} else {
+		pos = prtd->pos;
+		sz = prtd->sz;
+	}
+
+	byte_offset = pos - prtd->start + sz - min(count, sz);
+	/* the end of the buffer is its start, alsa reports an invalid position otherwise */
+	if (byte_offset >= prtd->end - prtd->start)
+		byte_offset -= prtd->end - prtd->start;
+
+	debug_log("dma counter %u, byte_offset %u, pos 0x%llx, start 0x%llx\n",count,byte_offset,prtd->pos, prtd->start);
+	return byte_offset;
+}
+
 static snd_pcm_uframes_t
 	idma_pointer(struct snd_soc_component *component,struct snd_pcm_substream *substream)
 {
-	struct idma_ctrl *prtd = substream->runtime->private_data;
-	unsigned int byte_offset,count;
-	snd_pcm_sframes_t frames;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct idma_ctrl *prtd = runtime->private_data;
+	unsigned int byte_offset;
 	unsigned long flags;
 
 	
 	spin_lock_irqsave(&prtd->lock, flags);
-	count = readl(prtd->dma_base + DMA_EXE_BYTES_OFFSET) ;
-
-	byte_offset = prtd->pos - prtd->start;
-
-	byte_offset = byte_offset +  ( prtd->sz - count );
-		
-	frames = bytes_to_frames(substream->runtime, byte_offset);
-	
-	/* must set frame to 0 if reach to top, otherwise alsa will report invalid position error */
-	if(frames >= substream->runtime->buffer_size)
-		frames = 0;
-	
+	if (prtd->state & ST_RUNNING)
+		byte_offset = idma_hw_offset(prtd);
+	else
+		// stopped or paused, a restart begins at pos
+		byte_offset = prtd->pos - prtd->start;
 	spin_unlock_irqrestore(&prtd->lock, flags);
 	
-	debug_log("dma counter %ld, byte_offset %ld, pos 0x%llx, start 0x%llx\n",count,byte_offset,prtd->pos, prtd->start);
-	return frames;
+	return bytes_to_frames(runtime, byte_offset);
+}
+
+/*
+ * The pointer is where the engine reads, the samples before it are still
+ * in the i2s fifo. The engine keeps the fifo full while it runs and the
+ * fifo has no level register, so it counts at its depth.
+ */
+static snd_pcm_sframes_t
+	idma_delay(struct snd_soc_component *component,struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct idma_ctrl *prtd = runtime->private_data;
+
+	if (!(READ_ONCE(prtd->state) & ST_RUNNING))
+		return 0;
+
+	return bytes_to_frames(runtime, prtd->fifo_bytes);
 }
 
 
@@ -230,8 +344,21 @@ static int idma_trigger(struct snd_soc_component *component,struct snd_pcm_subst
 		break;
 
 	case SNDRV_PCM_TRIGGER_SUSPEND:
-	case SNDRV_PCM_TRIGGER_STOP:
 	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		/*
+		 * Resume where the engine is, not at the start of its period,
+		 * or the pointer goes back. Rounded up to whole bursts, the
+		 * engine has moved those already.
+		 */
+		if (prtd->state & ST_RUNNING) {
+			prtd->pos = prtd->start +
+				    round_up(idma_hw_offset(prtd),
+					     1u << ((prtd->cfg >> 24) & 0xf));
+			if (prtd->pos >= prtd->end)
+				prtd->pos = prtd->start;
+		}
+		fallthrough;
+	case SNDRV_PCM_TRIGGER_STOP:
 		prtd->state &= ~ST_RUNNING;
 		
 		// clear all configuration
@@ -254,118 +381,86 @@ static int idma_trigger(struct snd_soc_component *component,struct snd_pcm_subst
 
 static void idma_done(void *id, int bytes_xfer)
 {
-	struct snd_pcm_substream *substream = id;
-	struct idma_ctrl *prtd = substream->runtime->private_data;
+	struct idma_ctrl *prtd = id;
+	struct snd_pcm_substream *substream;
+	u32 reg;
 
-	if (prtd && (prtd->state & ST_RUNNING)){
-		
-		snd_pcm_period_elapsed(substream);
-		
-		
-		// must add lock on smp system, otherwise idma_pointer will return wrong point
-		spin_lock(&prtd->lock);
-		prtd->pos += prtd->sz;
-		spdif_start_transfer(prtd, substream);
-		spin_unlock(&prtd->lock);
+	// must add lock on smp system, otherwise idma_pointer will return wrong point
+	spin_lock(&prtd->lock);
+	// clear irq status together with moving pos on, idma_pointer looks at both
+	reg = readl(prtd->dma_base + DMA_CTR_REG_OFFSET);
+	writel(reg & ~DMA_CTR_DONE, prtd->dma_base + DMA_CTR_REG_OFFSET);
 
+	// no stream open, or it was stopped
+	substream = prtd->token;
+	if (!substream || !(prtd->state & ST_RUNNING)) {
+		spin_unlock(&prtd->lock);
+		return;
 	}
+
+	// the engine is on the queued period already, queue the one after it
+	prtd->pos = prtd->next;
+	prtd->sz = prtd->next_sz;
+	idma_next_period(prtd);
+	idma_queue_next(prtd);
+	spin_unlock(&prtd->lock);
+
+	snd_pcm_period_elapsed(substream);
 }
 
 static int idma_open(struct snd_soc_component *component,struct snd_pcm_substream *substream)
 {
 	struct snd_pcm_runtime *runtime = substream->runtime;
-	struct idma_ctrl *prtd;
-
-	struct snd_card *card = substream->pcm->card;
-	//struct snd_pcm *pcm = runtime->pcm;
+	struct idma_ctrl *prtd = &idma;
 	int ret = 0;
 
 	debug_log("%s enter\n",__FUNCTION__);
 
 	snd_soc_set_runtime_hwparams(substream, &idma_hardware);
+	runtime->hw.formats &= prtd->formats;
+	runtime->hw.buffer_bytes_max = prtd->buffer_bytes;
+	runtime->hw.period_bytes_min = prtd->period_bytes_min;
+	runtime->hw.period_bytes_max = prtd->buffer_bytes;
+	runtime->hw.periods_max = prtd->periods_max;
+
+	// the engine moves whole bursts
+	ret = snd_pcm_hw_constraint_step(runtime, 0, SNDRV_PCM_HW_PARAM_PERIOD_BYTES,
+					 IDMA_BURST);
+	if (ret < 0)
+		return ret;
 
-	prtd = kzalloc(sizeof(struct idma_ctrl), GFP_KERNEL);
-	if (prtd == NULL)
-		return -ENOMEM;
-
-
-	prtd->dma_irq = dma_irq;
-	prtd->fifo_base = fifo_base;
-	prtd->dma_base = dma_base;
-	
-	ret = request_irq(prtd->dma_irq, idma_irq_hanlder, 0, "idma-i2s", prtd);
-	if (ret < 0) {
-		pr_err("fail to claim dam irq , ret = %d\n", ret);
-		kfree(prtd);
+	// every queued transfer is a full period
+	ret = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+	if (ret < 0)
 		return ret;
-	}
 
-	spin_lock_init(&prtd->lock);
-	runtime->private_data = prtd;
+	// the buffer and the irq are there since construct and probe
+	spin_lock_irq(&prtd->lock);
+	prtd->state = 0;
 	prtd->token = (void *) substream;
+	spin_unlock_irq(&prtd->lock);
+	runtime->private_data = prtd;
 
-
-
-
-	if (dma_set_mask_and_coherent(card->dev,
-				      DMA_BIT_MASK(64))) {
-		if (dma_set_mask_and_coherent(card->dev,
-					      DMA_BIT_MASK(32))) {
-			dev_warn(card->dev,
-				 "No suitable DMA available\n");
-			return -ENOMEM;
-		}
-	}
-	
-	
-	if (substream) {
-		ret = preallocate_idma_buffer(substream->pcm,
-				SNDRV_PCM_STREAM_PLAYBACK);
-	}
-	
-	
-	
-	return ret;
+	return 0;
 }
 
 static int idma_close(struct snd_soc_component *component,struct snd_pcm_substream *substream)
 {
 	struct idma_ctrl *prtd = substream->runtime->private_data;
-	struct snd_dma_buffer *buf;
-	struct snd_card *card = substream->pcm->card;
 
 	debug_log("%s enter\n",__FUNCTION__);
+
+	spin_lock_irq(&prtd->lock);
 	// clear all configuration
 	writel(0, prtd->dma_base + DMA_CFG_REG_OFFSET);
 	// clear  channel
 	writel(0, prtd->dma_base + DMA_CTR_REG_OFFSET);
-	
-	
-	if (!substream)
-		return -ENOMEM;
-
-	buf = &substream->dma_buffer;
-	if (!buf->area)
-		return -ENOMEM;
-
-	
-	dma_free_coherent(card->dev, buf->bytes,
-				      buf->area, buf->addr);
-
-	buf->area = NULL;
-	buf->addr = 0;
+	prtd->state = 0;
+	prtd->token = NULL;
+	spin_unlock_irq(&prtd->lock);
 
-
-
-
-
-	free_irq(prtd->dma_irq, prtd);
-
-
-	if (!prtd)
-		pr_err("idma_close called with prtd == NULL\n");
-
-	kfree(prtd);
+	// the irq stays requested, let a running handler finish with the substream
+	synchronize_irq(prtd->dma_irq);
 
 	return 0;
 }
@@ -374,49 +469,13 @@ static int idma_close(struct snd_soc_component *component,struct snd_pcm_substre
 
 
 
+// the pcm goes away, the managed buffer is freed by the core after this
 static void axi_dma_free(struct snd_soc_component *component,struct snd_pcm *pcm)
 {
-	struct snd_pcm_substream *substream;
-	struct snd_dma_buffer *buf;
-
-	substream = pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream;
-	if (!substream)
-		return;
-
-	buf = &substream->dma_buffer;
-	if (!buf->area)
-		return;
-
-	
-	dma_free_coherent(pcm->card->dev, buf->bytes,
-				      buf->area, buf->addr);
-
-	buf->area = NULL;
-	buf->addr = 0;
-}
-
-static int preallocate_idma_buffer(struct snd_pcm *pcm, int stream)
-{
-	struct snd_pcm_substream *substream = pcm->streams[stream].substream;
-	struct snd_dma_buffer *buf = &substream->dma_buffer;
-	size_t size = idma_hardware.buffer_bytes_max;
-
-	buf->dev.dev = pcm->card->dev;
-	buf->private_data = NULL;
-
-	/* Assign PCM buffer pointers, dma_alloc_writecombine will return physical address */
-	buf->dev.type = SNDRV_DMA_TYPE_DEV;
-	buf->area = dma_alloc_coherent(pcm->card->dev, size, &buf->addr, GFP_KERNEL);
-	if(!buf->area){
-		printk("failed to alloc dma buff\n");
-		return -ENOMEM;
-	}
-	
-	printk("dma memory PHY addr 0x%llx,size of dma size %d\n",buf->addr,sizeof(buf->addr));
-	
-	buf->bytes = size;
-	
-	return 0;
+	// clear all configuration
+	writel(0, idma.dma_base + DMA_CFG_REG_OFFSET);
+	// clear  channel
+	writel(0, idma.dma_base + DMA_CTR_REG_OFFSET);
 }
 
 static u64 idma_mask = DMA_BIT_MASK(32);
@@ -425,7 +484,6 @@ static int axi_dma_new(struct snd_soc_component *component,struct snd_soc_pcm_ru
 {
 	struct snd_card *card = rtd->card->snd_card;
 	struct snd_pcm *pcm = rtd->pcm;
-	int ret = 0;
 
 
 
@@ -447,24 +505,20 @@ static int axi_dma_new(struct snd_soc_component *component,struct snd_soc_pcm_ru
 		card->dev->coherent_dma_mask = DMA_BIT_MASK(32);
 	*/
 
-	if (pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream) {
-		ret = preallocate_idma_buffer(pcm,
-				SNDRV_PCM_STREAM_PLAYBACK);
-	}
-
-	return ret;
+	/*
+	 * Allocated once for the life of the card at the full buffer_bytes,
+	 * hw_params takes it from here and opening a stream allocates nothing.
+	 */
+	return snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_DEV, card->dev,
+					      idma.buffer_bytes, idma.buffer_bytes);
 }
 
 static irqreturn_t idma_irq_hanlder(int irqno, void *dev_id)
 {
 	struct idma_ctrl *prtd = dev_id;
-	u32 reg;
 
-	// clear irq status
-	//reg = readl(prtd->dma_base + DMA_CTR_REG_OFFSET);
-	//writel(reg| (1<< 30),prtd->dma_base + DMA_CTR_REG_OFFSET);
-
-	idma_done(prtd->token,0);
+	// the channel keeps running, idma_done clears the done bit
+	idma_done(prtd,0);
 	
 	return IRQ_HANDLED;
 }
@@ -502,23 +556,64 @@ static const struct snd_soc_component_driver mx_idma_platform = {
 	.close		= idma_close,
 	.trigger	= idma_trigger,
 	.pointer	= idma_pointer,
-	/* .mmap		= idma_mmap, */
+	.delay		= idma_delay,
+	.mmap		= idma_mmap,
 	.hw_params	= idma_hw_params,
-	.hw_free	= idma_hw_free,
 	.prepare	= idma_prepare,
-	/* .pcm_construct	= axi_dma_new, */
-	/* .pcm_destruct	= axi_dma_free, */
+	.pcm_construct	= axi_dma_new,
+	.pcm_destruct	= axi_dma_free,
 };
 
-void mx_idma_init(struct platform_device *pdev, int irq,dma_addr_t fifo_addr,void __iomem *dma_reg)
+static void mx_idma_parse_dt(struct platform_device *pdev, struct idma_ctrl *prtd)
 {
-	dma_irq = irq;
-	fifo_base = fifo_addr;
-	dma_base = dma_reg;
-	if( devm_snd_soc_register_component(&pdev->dev, &mx_idma_platform,
-					       NULL, 0)){
-		dev_err(&pdev->dev, "failed to register dma driver\n");
+	struct device_node *np = pdev->dev.of_node;
+
+	prtd->buffer_bytes = buffer_bytes;
+	prtd->period_bytes_min = period_bytes_min;
+	prtd->periods_max = periods_max;
+	prtd->fifo_bytes = fifo_bytes;
+
+	of_property_read_u32(np, "mx,buffer-bytes", &prtd->buffer_bytes);
+	of_property_read_u32(np, "mx,period-bytes-min", &prtd->period_bytes_min);
+	of_property_read_u32(np, "mx,periods-max", &prtd->periods_max);
+	of_property_read_u32(np, "mx,fifo-bytes", &prtd->fifo_bytes);
+
+	prtd->buffer_bytes = clamp_t(unsigned int, PAGE_ALIGN(prtd->buffer_bytes),
+				     PAGE_SIZE, MAX_IDMA_BUFFER);
+	prtd->period_bytes_min = clamp_t(unsigned int,
+					 ALIGN(prtd->period_bytes_min, IDMA_BURST),
+					 IDMA_BURST, prtd->buffer_bytes);
+	prtd->periods_max = clamp_t(unsigned int, prtd->periods_max, 1, MAX_IDMA_PERIODS);
+
+	dev_info(&pdev->dev, "dma buffer %u bytes, periods of %u bytes or more, at most %u\n",
+		 prtd->buffer_bytes, prtd->period_bytes_min, prtd->periods_max);
+}
+
+int mx_idma_init(struct platform_device *pdev, int irq,dma_addr_t fifo_addr,void __iomem *dma_reg,
+		 u64 formats)
+{
+	int ret;
+
+	mx_idma_parse_dt(pdev, &idma);
+
+	spin_lock_init(&idma.lock);
+	idma.dma_irq = irq;
+	idma.fifo_base = fifo_addr;
+	idma.dma_base = dma_reg;
+	idma.formats = formats;
+
+	ret = devm_request_irq(&pdev->dev, irq, idma_irq_hanlder, 0, "idma-i2s", &idma);
+	if (ret) {
+		dev_err(&pdev->dev, "fail to claim dma irq, ret = %d\n", ret);
+		return ret;
 	}
+
+	ret = devm_snd_soc_register_component(&pdev->dev, &mx_idma_platform,
+					      NULL, 0);
+	if (ret)
+		dev_err(&pdev->dev, "failed to register dma driver\n");
+
+	return ret;
 }
 
 EXPORT_SYMBOL_GPL(mx_idma_init);
@@ -53,6 +53,24 @@ i2s0: i2s@f8050000 {
 	interrupt-parent = <&plic>;
 	interrupts = <5>;
 
+	// optional, what the bitstream was built with: the sample width
+	// (16, 24 or 32, 24 bit samples sit in 32 bit slots), the slots in
+	// a frame (2 is i2s or left justified, more is tdm) and whether it
+	// can take the bit clock and frame from the codec. The fabric has
+	// no registers, the dma writes the samples as they are to the fifo,
+	// so the stream must match exactly. Without them it is 16 bit
+	// stereo with the core as clock master.
+	mx,sample-bits = <16>;
+	mx,slots = <2>;
+	mx,clock-consumer;
+
+	// optional, dma buffer and period limits, see axi_dma.c
+	mx,buffer-bytes = <0x100000>;
+	mx,period-bytes-min = <256>;
+	mx,periods-max = <1024>;
+	// optional, the tx fifo depth for the playback delay, 64 if not set
+	mx,fifo-bytes = <64>;
+
 	status = "okay";
 };
 
@@ -73,23 +91,91 @@ struct mx_i2s_dev {
 	int					clk_use_no;
 	int dma_irq;
 
+	/* what the fabric was built with, from the device tree */
+	u64					formats;	/* the one sample format */
+	unsigned int				slots;		/* 2 for i2s, more is tdm */
+	unsigned int				slot_width;
+	bool					clock_consumer;
+	struct snd_soc_dai_driver		dai;
+
 };
 
 
 
-#define MX_I2S_RATES		SNDRV_PCM_RATE_48000
+/* as clock master the core makes 48 kHz, a codec master can run any rate */
+#define MX_I2S_RATES		SNDRV_PCM_RATE_8000_192000
+#define MX_I2S_MASTER_RATE	48000
 
-#define MX_I2S_FORMATS	SNDRV_PCM_FMTBIT_S16_LE
+#define MX_I2S_FORMATS	(SNDRV_PCM_FMTBIT_S16_LE | \
+			 SNDRV_PCM_FMTBIT_S24_LE | \
+			 SNDRV_PCM_FMTBIT_S32_LE)
+
+#define MX_I2S_MAX_SLOTS	16
 
 
 static int mx_i2s_set_dai_fmt(struct snd_soc_dai *dai, unsigned int fmt)
 {
 	struct mx_i2s_dev *dev = snd_soc_dai_get_drvdata(dai);
 
+	// a fabric without the clock inputs is always the master
+	if ((fmt & SND_SOC_DAIFMT_MASTER_MASK) == SND_SOC_DAIFMT_CBM_CFM &&
+	    !dev->clock_consumer)
+		return -EINVAL;
+
+	// the frame is fixed, a stereo pair for i2s, all the slots for tdm
+	switch (fmt & SND_SOC_DAIFMT_FORMAT_MASK) {
+	case SND_SOC_DAIFMT_I2S:
+	case SND_SOC_DAIFMT_LEFT_J:
+		if (dev->slots != 2)
+			return -EINVAL;
+		break;
+	case SND_SOC_DAIFMT_DSP_A:
+	case SND_SOC_DAIFMT_DSP_B:
+		if (dev->slots <= 2)
+			return -EINVAL;
+		break;
+	}
+
 	dev->fmt = fmt;
 	return 0;
 }
 
+static int mx_i2s_set_tdm_slot(struct snd_soc_dai *dai, unsigned int tx_mask,
+			       unsigned int rx_mask, int slots, int slot_width)
+{
+	struct mx_i2s_dev *dev = snd_soc_dai_get_drvdata(dai);
+
+	// nothing to program, the card can only ask for what the fabric has
+	if (slots && (slots != dev->slots || slot_width != dev->slot_width))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * The dai advertises the fabric's one format and slot count, narrow the rate
+ * to what the clocking set_fmt chose can make before the stream is set up.
+ */
+static int mx_i2s_startup(struct snd_pcm_substream *substream,
+			  struct snd_soc_dai *dai)
+{
+	struct mx_i2s_dev *dev = snd_soc_dai_get_drvdata(dai);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int ret;
+
+	if ((dev->fmt & SND_SOC_DAIFMT_MASTER_MASK) == SND_SOC_DAIFMT_CBS_CFS) {
+		ret = snd_pcm_hw_constraint_single(runtime, SNDRV_PCM_HW_PARAM_RATE,
+						   MX_I2S_MASTER_RATE);
+		if (ret < 0)
+			return ret;
+	}
+
+	// one channel per slot, the dma fills every slot of the frame
+	ret = snd_pcm_hw_constraint_single(runtime, SNDRV_PCM_HW_PARAM_CHANNELS,
+					   dev->slots);
+	return ret < 0 ? ret : 0;
+}
+
 static int mx_i2s_prepare(struct snd_pcm_substream *substream,
 			     struct snd_soc_dai *dai)
 {
@@ -103,12 +189,22 @@ static int mx_i2s_hw_params(struct snd_pcm_substream *substream,
 			       struct snd_soc_dai *dai)
 {
 	struct mx_i2s_dev *dev = snd_soc_dai_get_drvdata(dai);
+	unsigned int channels = params_channels(params);
+	bool tdm;
 
 
 
 
 	switch (dev->fmt & SND_SOC_DAIFMT_FORMAT_MASK) {
 	case SND_SOC_DAIFMT_I2S:
+	case SND_SOC_DAIFMT_LEFT_J:
+		tdm = false;
+		break;
+
+	/* tdm, all slots in one frame after a one bit frame sync */
+	case SND_SOC_DAIFMT_DSP_A:
+	case SND_SOC_DAIFMT_DSP_B:
+		tdm = true;
 		break;
 
 	default:
@@ -120,6 +216,14 @@ static int mx_i2s_hw_params(struct snd_pcm_substream *substream,
 	switch (dev->fmt & SND_SOC_DAIFMT_MASTER_MASK) {
 	case SND_SOC_DAIFMT_CBS_CFS:
 		/* codec is slave, so cpu is master */
+		if (params_rate(params) != MX_I2S_MASTER_RATE) {
+			dev_err(dev->dev, "as clock master only %u Hz\n", MX_I2S_MASTER_RATE);
+			return -EINVAL;
+		}
+		break;
+
+	case SND_SOC_DAIFMT_CBM_CFM:
+		/* codec drives bit clock and frame, the rate is its own */
 		break;
 
 	default:
@@ -128,26 +232,26 @@ static int mx_i2s_hw_params(struct snd_pcm_substream *substream,
 	}
 
 
-	switch (params_channels(params)) {
-	case 1:
-		dev_err(dev->dev, "unsupported number of audio channels: 1\n");
-		break;
-	case 2:
-		break;
-	default:
-		dev_err(dev->dev, "unsupported number of audio channels\n");
+	if (!(dev->formats & pcm_format_to_bits(params_format(params)))) {
+		dev_err(dev->dev, "unsupported PCM format\n");
 		return -EINVAL;
 	}
-	
 
-	switch (params_format(params)) {
-	case SNDRV_PCM_FORMAT_S16_LE:
-		break;
 
-	default:
-		dev_err(dev->dev, "unsupported PCM format\n");
+	// the samples go to the fifo as they are, one per slot
+	if (channels != dev->slots || (!tdm && channels != 2)) {
+		dev_err(dev->dev, "unsupported number of audio channels: %u\n", channels);
+		return -EINVAL;
+	}
+
+	if (params_physical_width(params) != dev->slot_width) {
+		dev_err(dev->dev, "%u bit slots for %d bit samples\n", dev->slot_width,
+			params_physical_width(params));
 		return -EINVAL;
 	}
+
+	dev_dbg(dev->dev, "%u channels in %u slots of %u bits\n", channels,
+		dev->slots, dev->slot_width);
 	return 0;
 }
 
@@ -181,10 +285,12 @@ static int mx_i2s_trigger(struct snd_pcm_substream *substream, int cmd,
 }
 
 static const struct snd_soc_dai_ops mx_i2s_dai_ops = {
+	.startup	= mx_i2s_startup,
 	.prepare	= mx_i2s_prepare,
 	.trigger	= mx_i2s_trigger,
 	.hw_params	= mx_i2s_hw_params,
 	.set_fmt	= mx_i2s_set_dai_fmt,
+	.set_tdm_slot	= mx_i2s_set_tdm_slot,
 };
 
 static int mx_i2s_dai_probe(struct snd_soc_dai *dai)
@@ -195,11 +301,12 @@ static int mx_i2s_dai_probe(struct snd_soc_dai *dai)
 	return 0;
 }
 
-static struct snd_soc_dai_driver mx_i2s_dai = {
+// everything the core can do, mx_i2s_parse_dt narrows a copy to the fabric
+static const struct snd_soc_dai_driver mx_i2s_dai = {
 	.probe	= mx_i2s_dai_probe,
 	.playback = {
-		.channels_min = 2,
-		.channels_max = 2,
+		.channels_min = 1,
+		.channels_max = MX_I2S_MAX_SLOTS,
 		.rates = MX_I2S_RATES,
 		.formats = MX_I2S_FORMATS,
 	},
@@ -226,8 +333,58 @@ static const struct of_device_id mx_i2s_dt_ids[] = {
 
 MODULE_DEVICE_TABLE(of, mx_i2s_dt_ids);
 
+/*
+ * The bitstream is built for one sample width, one slot count and one way of
+ * clocking, only that is advertised.
+ */
+static int mx_i2s_parse_dt(struct mx_i2s_dev *dev, struct device_node *np)
+{
+	u32 bits = 16;
+
+	of_property_read_u32(np, "mx,sample-bits", &bits);
+	switch (bits) {
+	case 16:
+		dev->formats = SNDRV_PCM_FMTBIT_S16_LE;
+		dev->slot_width = 16;
+		break;
+	case 24:
+		dev->formats = SNDRV_PCM_FMTBIT_S24_LE;
+		dev->slot_width = 32;
+		break;
+	case 32:
+		dev->formats = SNDRV_PCM_FMTBIT_S32_LE;
+		dev->slot_width = 32;
+		break;
+	default:
+		dev_err(dev->dev, "mx,sample-bits: no %u bit samples\n", bits);
+		return -EINVAL;
+	}
+
+	dev->slots = 2;
+	of_property_read_u32(np, "mx,slots", &dev->slots);
+	if (dev->slots < 2 || dev->slots > MX_I2S_MAX_SLOTS) {
+		dev_err(dev->dev, "mx,slots: %u slots\n", dev->slots);
+		return -EINVAL;
+	}
+
+	dev->clock_consumer = of_property_read_bool(np, "mx,clock-consumer");
 
-extern void mx_idma_init(struct platform_device *pdev, int irq,dma_addr_t fifo_addr,void __iomem *dma_reg);
+	dev->dai = mx_i2s_dai;
+	dev->dai.playback.formats = dev->formats;
+	dev->dai.playback.channels_min = dev->slots;
+	dev->dai.playback.channels_max = dev->slots;
+	dev->dai.playback.rates = dev->clock_consumer ? MX_I2S_RATES :
+				  SNDRV_PCM_RATE_48000;
+
+	dev_info(dev->dev, "%u bit samples in %u slots of %u bits, %s\n", bits,
+		 dev->slots, dev->slot_width,
+		 dev->clock_consumer ? "codec or cpu clocks" : "cpu clocks");
+	return 0;
+}
+
+
+extern int mx_idma_init(struct platform_device *pdev, int irq,dma_addr_t fifo_addr,void __iomem *dma_reg,
+			u64 formats);
 static int mx_i2s_probe(struct platform_device *pdev)
 {
 	struct device_node *np = pdev->dev.of_node;
@@ -279,15 +436,21 @@ static int mx_i2s_probe(struct platform_device *pdev)
 	dev->dev = &pdev->dev;
 	platform_set_drvdata(pdev, dev);
 
+	err = mx_i2s_parse_dt(dev, np);
+	if (err)
+		return err;
+
 	err = devm_snd_soc_register_component(&pdev->dev,
 					      &mx_i2s_component,
-					      &mx_i2s_dai, 1);
+					      &dev->dai, 1);
 	if (err) {
 		dev_err(&pdev->dev, "failed to register DAI: %d\n", err);
 		return err;
 	}
 
-	mx_idma_init(pdev,dev->dma_irq,fifo->start,base);
+	err = mx_idma_init(pdev,dev->dma_irq,fifo->start,base,dev->formats);
+	if (err)
+		return err;
 	
 /*
 
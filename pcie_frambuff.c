@@ -12,6 +12,18 @@
 #include <linux/timex.h>
 #include <linux/timer.h>
 #include <linux/fb.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+
+#include "pcie_frambuff.h"
 
 #define DRIVER_NAME "test_pcie"
 
@@ -21,6 +33,60 @@
 #define AXI_BAR_ALIGN_SIZE (4*1024*1024)
 #define BITS_PER_PIX 32
 
+#define PCIEFB_MAX_RANGES 8
+#define PCIEFB_PRESENT_DEPTH 8
+
+static unsigned int refresh_rate = 60;
+module_param(refresh_rate, uint, 0444);
+MODULE_PARM_DESC(refresh_rate, "frame rate of the descriptor submission queue");
+
+static bool numa_local = true;
+module_param(numa_local, bool, 0444);
+MODULE_PARM_DESC(numa_local, "host window on the device's numa node, a streaming mapping");
+
+static bool cached_mmap;
+module_param(cached_mmap, bool, 0444);
+MODULE_PARM_DESC(cached_mmap, "cached host window, writers must use PCIEFB_IOC_SYNC");
+
+struct pcie_dev_adapter;
+
+struct pciefb_stats {
+	u64 frames;			/* complete frames written to the card */
+	u64 descs;
+	u64 bytes;
+	u64 dma_errors;
+	u64 rejected;			/* descriptors failing the client checks */
+	u64 xfer_last_ns;
+	u64 xfer_min_ns;
+	u64 xfer_max_ns;
+	u64 xfer_total_ns;
+	u64 xfer_count;
+	ktime_t since;
+};
+
+struct pciefb_present_entry {
+	u32 id;
+	u32 src_offset;
+	u32 length;
+	ktime_t target;
+};
+
+struct pciefb_client {
+	struct list_head node;
+	struct pcie_dev_adapter *adapter;
+	struct pciefb_ring *ring;	/* shared with the client */
+	u32 head;			/* private copies, never read back from the ring */
+	u32 done;
+	u64 poll_budget_ns;		/* busy poll before sleeping, 0 is irq only */
+	struct pciefb_present_entry present[PCIEFB_PRESENT_DEPTH]; /* by target */
+	int nr_present;
+	u32 present_queued;		/* every one gets a present_done entry */
+	u32 present_done;
+	struct pciefb_range ranges[PCIEFB_MAX_RANGES];
+	int nr_ranges;
+	wait_queue_head_t wait;
+};
+
 struct pcie_dev_adapter{
 	struct pci_dev *pdev;
 	u8 __iomem *mem_space_addr;
@@ -29,16 +95,46 @@ struct pcie_dev_adapter{
 	void *cpu_ptr;
 	dma_addr_t dma_ptr_unalign;
 	void *cpu_ptr_unalign;
+	struct page *fb_page;		/* node local window, NULL for the coherent pool */
+	int fb_noncoherent;		/* cached_mmap, from dma_alloc_noncoherent */
+	int fb_streaming;		/* cached, needs syncs before the dma reads it */
+	phys_addr_t fb_phys;
+	int node;
+	int fb_node;
 	struct fb_info *fb_info;
 	u8 flag;
+
+	spinlock_t lock;		/* clients list and inflight, taken from irq */
+	struct mutex client_mutex;	/* mode switch on open/release */
+	struct list_head clients;
+	int nr_clients;
+	struct pciefb_client *inflight;
+	u32 inflight_idx;
+	int inflight_present;		/* inflight_entry is a timed present */
+	struct pciefb_present_entry inflight_entry;
+	u32 inflight_len;
+	u32 inflight_dst_end;
+	int busy;
+	int tick_pending;		/* the frame tick found the engine busy */
+	struct hrtimer frame_timer;
+	ktime_t frame_period;
+
+	ktime_t start_t;		/* descriptor started, queue mode */
+	ktime_t end_t;			/* last completion irq, cyclic mode */
+	struct pciefb_stats stats;
+	struct dentry *debugfs;
+
+	int id;				/* pciefb_submit<id>, test_pcie<id> in debugfs */
+	char submit_name[32];
+	struct miscdevice submit_dev;
+	struct kref ref;		/* probe and every open submit client */
+	int gone;			/* removed, the clients only see -ENODEV */
 };	
 
 
 static volatile int dma_done = 0;
-struct pcie_dev_adapter *g_adapter;
 
-ktime_t start_t;
-ktime_t end_t;
+static DEFINE_IDA(pciefb_ida);
 
 
 #define DMA_DESC_OFFSET 0x0000
@@ -55,22 +151,192 @@ ktime_t end_t;
 
 #define FRAME_SIZE (IMAGE_HEIGHT*IMAGE_WIDTH*( BITS_PER_PIX/8) )
 
+// the AXI BAR window, it is translated to adapter->dma_ptr
+#define HOST_WINDOW_SIZE AXI_BAR_ALIGN_SIZE
+
+// CDMA control and status register bits
+#define DMA_CR_RESET		(1 << 2)
+#define DMA_CR_SG_MODE		(1 << 3)
+#define DMA_CR_CYCLIC		(1 << 6)
+#define DMA_CR_IOC_IRQ_EN	(1 << 12)
+#define DMA_CR_ERR_IRQ_EN	(1 << 14)
+#define DMA_CR_IRQ_THRESHOLD(n)	((n) << 16)
+#define DMA_SR_IDLE		(1 << 1)
+#define DMA_SR_IOC_IRQ		(1 << 12)
+#define DMA_SR_ERR_IRQ		(1 << 14)
+
+// descriptor status word, offset 0x1c
+#define DMA_DESC_STS_CMPLT	(1u << 31)
+#define DMA_DESC_STS_ERR	(7u << 28)
+
+// upper limit of the per fd busy poll budget, every iteration is a bus read
+#define PCIEFB_MAX_POLL_US 10
+
+// the cyclic fb output raises one irq every n frames, only for the stats,
+// a cached window takes one per frame to write it back before the next pass
+#define MIRROR_IRQ_FRAMES 8
+
+
+void dma_init(struct pcie_dev_adapter *adapter);
+static void dma_queue_init(struct pcie_dev_adapter *adapter);
+static void pciefb_complete_desc(struct pciefb_client *client, u32 idx,
+				 u32 status);
+static void pciefb_present_feedback(struct pciefb_client *client,
+				    const struct pciefb_present_entry *entry,
+				    u32 status, ktime_t present);
+static void pciefb_submit_next(struct pcie_dev_adapter *adapter);
+static bool pciefb_submit_client(struct pcie_dev_adapter *adapter,
+				 struct pciefb_client *client);
+static void pciefb_sync_for_device(struct pcie_dev_adapter *adapter,
+				   u32 offset, u32 len);
+
+// called with adapter->lock held
+static void pciefb_account(struct pcie_dev_adapter *adapter, u32 frames,
+			   u32 descs, u64 bytes, u64 xfer_ns)
+{
+	struct pciefb_stats *st = &adapter->stats;
+
+	st->frames += frames;
+	st->descs += descs;
+	st->bytes += bytes;
+
+	if(!xfer_ns)
+		return;
+	st->xfer_last_ns = xfer_ns;
+	if(!st->xfer_count || xfer_ns < st->xfer_min_ns)
+		st->xfer_min_ns = xfer_ns;
+	if(xfer_ns > st->xfer_max_ns)
+		st->xfer_max_ns = xfer_ns;
+	st->xfer_total_ns += xfer_ns;
+	st->xfer_count++;
+}
 
-static irqreturn_t dma_isr(int irq, void *dev_id)
+/*
+ * Retire the descriptor in flight. Both the irq and a busy polling waiter
+ * get here, whoever comes first wins and the other one finds busy cleared.
+ * Called with adapter->lock held.
+ */
+static void pciefb_finish_inflight(struct pcie_dev_adapter *adapter, u32 status)
 {
+	struct pciefb_client *client = adapter->inflight;
+	int present = adapter->inflight_present;
+	ktime_t now = ktime_get();
+
+	if(status == PCIEFB_DESC_DONE)
+		pciefb_account(adapter,
+			       adapter->inflight_dst_end == FRAME_SIZE, 1,
+			       adapter->inflight_len,
+			       ktime_to_ns(ktime_sub(now, adapter->start_t)));
+	else
+		adapter->stats.dma_errors++;
+
+	if(adapter->inflight && adapter->inflight_present)
+		pciefb_present_feedback(adapter->inflight,
+					&adapter->inflight_entry, status,
+					status == PCIEFB_DESC_DONE ? now : 0);
+	else if(adapter->inflight)
+		pciefb_complete_desc(adapter->inflight, adapter->inflight_idx,
+				     status);
+	adapter->inflight = NULL;
+	adapter->busy = 0;
+
+	// the engine halts on error, it needs a reset before the next descriptor
+	if(status == PCIEFB_DESC_EIO)
+		dma_queue_init(adapter);
+
+	/*
+	 * A frame boundary passed while this one ran, do what the tick could
+	 * not. Otherwise only the chunks the same client queued go back to
+	 * back, presents and the other clients wait for the next tick.
+	 */
+	if (adapter->tick_pending) {
+		adapter->tick_pending = 0;
+		pciefb_submit_next(adapter);
+	} else if (client && !present && !adapter->gone) {
+		pciefb_submit_client(adapter, client);
+	}
+}
+
+static u32 pciefb_mirror_frames(struct pcie_dev_adapter *adapter)
+{
+	return adapter->fb_streaming ? 1 : MIRROR_IRQ_FRAMES;
+}
+
 /*
-	u8  *dma_base = g_adapter->mem_space_addr + DMA_CTL_OFFSET;
+ * cyclic fb output, one irq per pciefb_mirror_frames(). The engine starts
+ * the next pass right away, so a store the writer did not flush shows up
+ * a frame late at worst, never stays in the cache.
+ */
+static void pciefb_mirror_irq(struct pcie_dev_adapter *adapter)
+{
+	u32 frames = pciefb_mirror_frames(adapter);
+	ktime_t now = ktime_get();
+	u64 xfer_ns = 0;
+
+	pciefb_sync_for_device(adapter, 0, FRAME_SIZE);
+
+	if(adapter->end_t)
+		xfer_ns = div_u64(ktime_to_ns(ktime_sub(now, adapter->end_t)),
+				  frames);
+	adapter->end_t = now;
+
+	pciefb_account(adapter, frames, frames, (u64)FRAME_SIZE * frames,
+		       xfer_ns);
+}
+
+// check the status word the engine writes back, called with adapter->lock held
+static bool pciefb_reap(struct pcie_dev_adapter *adapter)
+{
+	u32 sts;
+
+	if(!adapter->busy)
+		return false;
+
+	sts = ioread32(adapter->mem_space_addr + DMA_DESC_OFFSET + 0x1c);
+	if(!(sts & DMA_DESC_STS_CMPLT))
+		return false;
+
+	pciefb_finish_inflight(adapter, (sts & DMA_DESC_STS_ERR) ?
+			       PCIEFB_DESC_EIO : PCIEFB_DESC_DONE);
+	return true;
+}
+
+static irqreturn_t dma_isr(int irq, void *dev_id)
+{
+	struct pcie_dev_adapter *adapter = dev_id;
+	u8  *dma_base = adapter->mem_space_addr + DMA_CTL_OFFSET;
+	unsigned long flags;
 	u32 val;
-	
-	end_t = ktime_get();
-	printk("dma irq\n");
+
 	val = ioread32(dma_base+4);
-	if(val & (1 << 12) ){ // dma done
-		printk("dma done\n");
-		iowrite32(1 << 12, dma_base + 4);
-		dma_done = 1;
+	if(!(val & (DMA_SR_IOC_IRQ | DMA_SR_ERR_IRQ)))
+		return IRQ_NONE;
+
+	iowrite32(val & (DMA_SR_IOC_IRQ | DMA_SR_ERR_IRQ), dma_base + 4);
+
+	spin_lock_irqsave(&adapter->lock, flags);
+
+	if(val & DMA_SR_ERR_IRQ){
+		dev_err_ratelimited(&adapter->pdev->dev, "dma error, status 0x%x\n", val);
+		if(adapter->busy) {
+			pciefb_finish_inflight(adapter, PCIEFB_DESC_EIO);
+		} else {
+			adapter->stats.dma_errors++;
+			// the engine halted, the cyclic output would stay frozen
+			if(READ_ONCE(adapter->nr_clients))
+				dma_queue_init(adapter);
+			else if(adapter->flag)
+				dma_init(adapter);
+		}
 	}
-*/
+	else if(READ_ONCE(adapter->nr_clients))
+		// a polling waiter may have retired it already
+		pciefb_reap(adapter);
+	else
+		pciefb_mirror_irq(adapter);
+
+	spin_unlock_irqrestore(&adapter->lock, flags);
+
 	return IRQ_HANDLED;
 
 }
@@ -78,15 +344,15 @@ static irqreturn_t dma_isr(int irq, void *dev_id)
 
 
 
-void dma_init(void)
+void dma_init(struct pcie_dev_adapter *adapter)
 {
-	void  *dma_ctl_base = g_adapter->mem_space_addr + DMA_CTL_OFFSET;
-	void *dma_desc_base = g_adapter->mem_space_addr  + DMA_DESC_OFFSET;
-	void *pcie_ctl_base = g_adapter->mem_space_addr + PCIE_CTL_OFFSET;
+	void  *dma_ctl_base = adapter->mem_space_addr + DMA_CTL_OFFSET;
+	void *dma_desc_base = adapter->mem_space_addr  + DMA_DESC_OFFSET;
+	void *pcie_ctl_base = adapter->mem_space_addr + PCIE_CTL_OFFSET;
 	dma_addr_t dma_addr;
 
 	// set AXI->PCIE translation table
-	dma_addr = g_adapter->dma_ptr;
+	dma_addr = adapter->dma_ptr;
 	iowrite32((unsigned int)(dma_addr >> 32), pcie_ctl_base + 0x208);
 	iowrite32((unsigned int)dma_addr, pcie_ctl_base + 0x20c);
 		
@@ -106,20 +372,734 @@ void dma_init(void)
 	iowrite32(0,dma_desc_base+0x5c);			// status
 		
 	
+	adapter->end_t = 0;
 	iowrite32(4,dma_ctl_base);				// reset dma
-	iowrite32(0x48,dma_ctl_base);				// sg and cycle mode
+	iowrite32(0x48 | DMA_CR_IOC_IRQ_EN | DMA_CR_ERR_IRQ_EN |
+		  DMA_CR_IRQ_THRESHOLD(pciefb_mirror_frames(adapter)),dma_ctl_base);	// sg and cycle mode, irq for the stats
 	iowrite32(DMA_DESC_ADDR,dma_ctl_base+0x08);		// first descriptor
 	iowrite32(0x55555555,dma_ctl_base+0x10);		// just trigger dma to start
 
 
 }
 
-void dma_stop(void)
+void dma_stop(struct pcie_dev_adapter *adapter)
 {
-	void  *dma_ctl_base = g_adapter->mem_space_addr + DMA_CTL_OFFSET;
+	void  *dma_ctl_base = adapter->mem_space_addr + DMA_CTL_OFFSET;
 	iowrite32(4,dma_ctl_base);				// reset dma
 }
 
+/*
+ * queue mode: the engine runs one descriptor per submission and then
+ * goes idle, instead of cycling over the host buffer like dma_init() does
+ */
+static void dma_queue_init(struct pcie_dev_adapter *adapter)
+{
+	void  *dma_ctl_base = adapter->mem_space_addr + DMA_CTL_OFFSET;
+	void *pcie_ctl_base = adapter->mem_space_addr + PCIE_CTL_OFFSET;
+
+	iowrite32((unsigned int)(adapter->dma_ptr >> 32), pcie_ctl_base + 0x208);
+	iowrite32((unsigned int)adapter->dma_ptr, pcie_ctl_base + 0x20c);
+
+	iowrite32(DMA_CR_RESET, dma_ctl_base);
+	iowrite32(DMA_CR_SG_MODE | DMA_CR_IOC_IRQ_EN | DMA_CR_ERR_IRQ_EN,
+		  dma_ctl_base);
+}
+
+/*
+ * A cached window has to be written back before the engine reads it. Only
+ * the damaged range is cleaned, for the queue that is the descriptor.
+ */
+static void pciefb_sync_for_device(struct pcie_dev_adapter *adapter,
+				   u32 offset, u32 len)
+{
+	if (!adapter->fb_streaming || !len)
+		return;
+
+	dma_sync_single_range_for_device(&adapter->pdev->dev, adapter->dma_ptr,
+					 offset, len, DMA_TO_DEVICE);
+}
+
+// the engine never writes the window, this only keeps the dma api balanced
+static void pciefb_sync_for_cpu(struct pcie_dev_adapter *adapter,
+				u32 offset, u32 len)
+{
+	if (!adapter->fb_streaming || !len)
+		return;
+
+	dma_sync_single_range_for_cpu(&adapter->pdev->dev, adapter->dma_ptr,
+				      offset, len, DMA_TO_DEVICE);
+}
+
+static void dma_queue_desc(struct pcie_dev_adapter *adapter,
+			   u32 src, u32 dst, u32 len)
+{
+	void  *dma_ctl_base = adapter->mem_space_addr + DMA_CTL_OFFSET;
+	void *dma_desc_base = adapter->mem_space_addr + DMA_DESC_OFFSET;
+
+	pciefb_sync_for_device(adapter, src, len);
+
+	iowrite32(DMA_DESC_ADDR,dma_desc_base);			// next descriptor addr, unused
+	iowrite32(DMA_PCIE_BAR_ADDR + src,dma_desc_base+0x8);	// source addr
+	iowrite32(DMA_AXI_HDMI + dst,dma_desc_base+0x10);	// dest addr
+	iowrite32(len,dma_desc_base+0x18);			// length
+	iowrite32(0,dma_desc_base+0x1c);			// status
+
+	adapter->inflight_len = len;
+	adapter->inflight_dst_end = dst + len;
+	adapter->start_t = ktime_get();
+
+	// curdesc can only be written while idle, tail write starts the engine
+	iowrite32(DMA_DESC_ADDR,dma_ctl_base+0x08);
+	iowrite32(DMA_DESC_ADDR,dma_ctl_base+0x10);
+}
+
+
+static bool pciefb_desc_allowed(struct pciefb_client *client,
+				const struct pciefb_sub_desc *desc)
+{
+	u64 src_end = (u64)desc->src_offset + desc->length;
+	int i;
+
+	for (i = 0; i < client->nr_ranges; i++) {
+		if (desc->src_offset >= client->ranges[i].offset &&
+		    src_end <= (u64)client->ranges[i].offset +
+			       client->ranges[i].length)
+			return true;
+	}
+
+	return false;
+}
+
+static void pciefb_complete_desc(struct pciefb_client *client, u32 idx,
+				 u32 status)
+{
+	WRITE_ONCE(client->ring->desc[idx].status, status);
+	/* status must be visible before done moves */
+	smp_wmb();
+	client->done++;
+	WRITE_ONCE(client->ring->done, client->done);
+	wake_up_interruptible(&client->wait);
+}
+
+static void pciefb_present_feedback(struct pciefb_client *client,
+				    const struct pciefb_present_entry *entry,
+				    u32 status, ktime_t present)
+{
+	struct pciefb_present_done *fb;
+
+	fb = &client->ring->present[client->present_done % PCIEFB_PRESENT_ENTRIES];
+	WRITE_ONCE(fb->id, entry->id);
+	WRITE_ONCE(fb->status, status);
+	WRITE_ONCE(fb->target_ns, ktime_to_ns(entry->target));
+	WRITE_ONCE(fb->present_ns, ktime_to_ns(present));
+	/* entry must be visible before present_done moves */
+	smp_wmb();
+	client->present_done++;
+	WRITE_ONCE(client->ring->present_done, client->present_done);
+	wake_up_interruptible(&client->wait);
+}
+
+/*
+ * Pick the timed present that belongs to the frame starting now, that is
+ * the newest entry whose target is before the middle of this frame. Older
+ * due entries would never be seen, they are reported as skipped.
+ * Called with adapter->lock held.
+ */
+static bool pciefb_present_due(struct pcie_dev_adapter *adapter,
+			       struct pciefb_client *client, ktime_t now,
+			       struct pciefb_present_entry *entry)
+{
+	ktime_t limit = ktime_add_ns(now, ktime_to_ns(adapter->frame_period) / 2);
+	int i, due = 0;
+
+	while (due < client->nr_present &&
+	       ktime_before(client->present[due].target, limit))
+		due++;
+	if (!due)
+		return false;
+
+	for (i = 0; i < due - 1; i++)
+		pciefb_present_feedback(client, &client->present[i],
+					PCIEFB_PRESENT_SKIPPED, 0);
+	*entry = client->present[due - 1];
+
+	client->nr_present -= due;
+	memmove(&client->present[0], &client->present[due],
+		client->nr_present * sizeof(client->present[0]));
+
+	return true;
+}
+
+// timed presents go first, they are bound to this frame boundary
+static bool pciefb_submit_present(struct pcie_dev_adapter *adapter)
+{
+	struct pciefb_present_entry entry;
+	struct pciefb_sub_desc desc;
+	struct pciefb_client *client;
+	ktime_t now = ktime_get();
+
+	list_for_each_entry(client, &adapter->clients, node) {
+		while (pciefb_present_due(adapter, client, now, &entry)) {
+			// the claim may be gone since the entry was queued
+			desc.src_offset = entry.src_offset;
+			desc.length = entry.length;
+			if (!pciefb_desc_allowed(client, &desc)) {
+				adapter->stats.rejected++;
+				pciefb_present_feedback(client, &entry,
+							PCIEFB_DESC_EPERM, 0);
+				continue;
+			}
+
+			adapter->busy = 1;
+			adapter->inflight = client;
+			adapter->inflight_present = 1;
+			adapter->inflight_entry = entry;
+			dma_queue_desc(adapter, entry.src_offset, 0, entry.length);
+			list_move_tail(&client->node, &adapter->clients);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Start the next pending descriptor of one client. The entry is copied out
+ * of the shared page before it is checked, so the client can not change it
+ * behind our back. Called with adapter->lock held and the engine idle.
+ */
+static bool pciefb_submit_client(struct pcie_dev_adapter *adapter,
+				 struct pciefb_client *client)
+{
+	struct pciefb_sub_desc desc;
+	u32 tail, idx;
+
+	tail = READ_ONCE(client->ring->tail);
+	// garbage in tail, wait until the client fixes it
+	if (tail - client->head > PCIEFB_RING_ENTRIES)
+		return false;
+	/* read the entries only after tail */
+	smp_rmb();
+
+	while (client->head != tail) {
+		idx = client->head % PCIEFB_RING_ENTRIES;
+		memcpy(&desc, &client->ring->desc[idx], sizeof(desc));
+		client->head++;
+		WRITE_ONCE(client->ring->head, client->head);
+
+		if (!desc.length ||
+		    (u64)desc.dst_offset + desc.length > FRAME_SIZE) {
+			adapter->stats.rejected++;
+			pciefb_complete_desc(client, idx, PCIEFB_DESC_EINVAL);
+			continue;
+		}
+		if (!pciefb_desc_allowed(client, &desc)) {
+			adapter->stats.rejected++;
+			pciefb_complete_desc(client, idx, PCIEFB_DESC_EPERM);
+			continue;
+		}
+
+		adapter->busy = 1;
+		adapter->inflight = client;
+		adapter->inflight_idx = idx;
+		adapter->inflight_present = 0;
+		dma_queue_desc(adapter, desc.src_offset, desc.dst_offset,
+			       desc.length);
+		list_move_tail(&client->node, &adapter->clients);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Frame boundary work, the due timed presents first and then the queued
+ * descriptors, clients are served round robin.
+ * Called with adapter->lock held.
+ */
+static void pciefb_submit_next(struct pcie_dev_adapter *adapter)
+{
+	struct pciefb_client *client;
+
+	if (adapter->busy || adapter->gone)
+		return;
+
+	if (pciefb_submit_present(adapter))
+		return;
+
+	list_for_each_entry(client, &adapter->clients, node) {
+		if (pciefb_submit_client(adapter, client))
+			return;
+	}
+}
+
+/*
+ * Frame boundary, pick up timed presents and doorbells rung while idle. The
+ * card has no vblank interrupt, this is a free running timer, not scanout.
+ */
+static enum hrtimer_restart pciefb_frame_tick(struct hrtimer *timer)
+{
+	struct pcie_dev_adapter *adapter = container_of(timer,
+				struct pcie_dev_adapter, frame_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&adapter->lock, flags);
+	// the completion of the one in flight does it
+	if (adapter->busy)
+		adapter->tick_pending = 1;
+	else
+		pciefb_submit_next(adapter);
+	spin_unlock_irqrestore(&adapter->lock, flags);
+
+	// runs from the first open to the last close, the tail write is all
+	// a client does to queue, there is no doorbell syscall to restart it
+	hrtimer_forward_now(timer, adapter->frame_period);
+	return HRTIMER_RESTART;
+}
+
+
+static void pciefb_adapter_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct pcie_dev_adapter, ref));
+}
+
+static void pciefb_adapter_put(struct pcie_dev_adapter *adapter)
+{
+	kref_put(&adapter->ref, pciefb_adapter_free);
+}
+
+static int pciefb_client_open(struct inode *inode, struct file *file)
+{
+	struct pcie_dev_adapter *adapter = container_of(file->private_data,
+				struct pcie_dev_adapter, submit_dev);
+	struct pciefb_client *client;
+	unsigned long flags;
+	struct page *page;
+
+	client = kzalloc_node(sizeof(*client), GFP_KERNEL, adapter->node);
+	if (!client)
+		return -ENOMEM;
+
+	// the irq and the frame tick touch the ring, keep it next to them
+	page = alloc_pages_node(adapter->node, GFP_KERNEL | __GFP_ZERO, 0);
+	if (!page) {
+		kfree(client);
+		return -ENOMEM;
+	}
+	client->ring = page_address(page);
+
+	client->adapter = adapter;
+	init_waitqueue_head(&client->wait);
+	file->private_data = client;
+
+	mutex_lock(&adapter->client_mutex);
+	if (adapter->gone) {
+		mutex_unlock(&adapter->client_mutex);
+		free_page((unsigned long)client->ring);
+		kfree(client);
+		return -ENODEV;
+	}
+	kref_get(&adapter->ref);
+	if (adapter->nr_clients++ == 0) {
+		// the cyclic fb output and queued descriptors can not share the engine
+		if (adapter->flag)
+			dma_stop(adapter);
+		dma_queue_init(adapter);
+		adapter->busy = 0;
+		adapter->tick_pending = 0;
+		hrtimer_start(&adapter->frame_timer, adapter->frame_period,
+			      HRTIMER_MODE_REL);
+	}
+
+	spin_lock_irqsave(&adapter->lock, flags);
+	list_add_tail(&client->node, &adapter->clients);
+	spin_unlock_irqrestore(&adapter->lock, flags);
+	mutex_unlock(&adapter->client_mutex);
+
+	return 0;
+}
+
+static int pciefb_client_release(struct inode *inode, struct file *file)
+{
+	struct pciefb_client *client = file->private_data;
+	struct pcie_dev_adapter *adapter = client->adapter;
+	unsigned long flags;
+
+	mutex_lock(&adapter->client_mutex);
+
+	spin_lock_irqsave(&adapter->lock, flags);
+	list_del(&client->node);
+	// the irq still clears busy, it just has nobody to report to
+	if (adapter->inflight == client)
+		adapter->inflight = NULL;
+	spin_unlock_irqrestore(&adapter->lock, flags);
+
+	// after remove the engine and the timer are gone already
+	if (--adapter->nr_clients == 0 && !adapter->gone) {
+		hrtimer_cancel(&adapter->frame_timer);
+		dma_stop(adapter);
+		if (adapter->flag)
+			dma_init(adapter);
+	}
+	mutex_unlock(&adapter->client_mutex);
+
+	free_page((unsigned long)client->ring);
+	kfree(client);
+	pciefb_adapter_put(adapter);
+
+	return 0;
+}
+
+static int pciefb_client_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pciefb_client *client = file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff != 0 || size > PAGE_SIZE)
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(client->ring) >> PAGE_SHIFT,
+			       size, vma->vm_page_prot);
+}
+
+static __poll_t pciefb_client_poll(struct file *file, poll_table *wait)
+{
+	struct pciefb_client *client = file->private_data;
+	__poll_t mask = 0;
+	u32 tail;
+
+	poll_wait(file, &client->wait, wait);
+
+	tail = READ_ONCE(client->ring->tail);
+	// present results the client has not read yet, or nothing left to do
+	if (READ_ONCE(client->present_done) != READ_ONCE(client->ring->present_read) ||
+	    (READ_ONCE(client->done) == tail &&
+	     READ_ONCE(client->present_queued) == READ_ONCE(client->present_done)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (tail - READ_ONCE(client->done) < PCIEFB_RING_ENTRIES)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static bool pciefb_seq_done(struct pciefb_client *client, u32 seq)
+{
+	return (s32)(READ_ONCE(client->done) - seq) >= 0;
+}
+
+/*
+ * Wait until the client's done index reaches seq. With a poll budget the
+ * waiter first spins a few us on the status word of its own descriptor and
+ * retires it itself, so neither the MSI nor the wakeup is on its path. The
+ * descriptors of other clients are left to the irq.
+ */
+static int pciefb_wait_done(struct pciefb_client *client,
+			    const struct pciefb_wait *wait)
+{
+	struct pcie_dev_adapter *adapter = client->adapter;
+	unsigned long flags;
+	ktime_t end;
+	long ret;
+
+	if (client->poll_budget_ns && !READ_ONCE(adapter->gone)) {
+		end = ktime_add_ns(ktime_get(), client->poll_budget_ns);
+		do {
+			if (pciefb_seq_done(client, wait->seq))
+				return 0;
+			// under the lock, remove clears inflight before the bar goes
+			if (READ_ONCE(adapter->inflight) == client) {
+				spin_lock_irqsave(&adapter->lock, flags);
+				if (adapter->inflight == client)
+					pciefb_reap(adapter);
+				spin_unlock_irqrestore(&adapter->lock, flags);
+			}
+			cpu_relax();
+		} while (ktime_before(ktime_get(), end));
+	}
+
+	ret = wait_event_interruptible_timeout(client->wait,
+			pciefb_seq_done(client, wait->seq) || READ_ONCE(adapter->gone),
+			msecs_to_jiffies(wait->timeout_ms));
+	if (ret < 0)
+		return ret;
+	if (READ_ONCE(adapter->gone))
+		return -ENODEV;
+	if (!ret)
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+// queue a frame for a CLOCK_MONOTONIC target, the list is kept sorted
+static int pciefb_queue_present(struct pciefb_client *client,
+				const struct pciefb_present *req)
+{
+	struct pcie_dev_adapter *adapter = client->adapter;
+	struct pciefb_present_entry entry;
+	struct pciefb_sub_desc desc;
+	unsigned long flags;
+	int i, ret = 0;
+
+	entry.id = req->id;
+	entry.src_offset = req->src_offset;
+	entry.length = req->length ? req->length : FRAME_SIZE;
+	entry.target = ns_to_ktime(req->target_ns);
+
+	if (entry.length > FRAME_SIZE)
+		return -EINVAL;
+
+	desc.src_offset = entry.src_offset;
+	desc.length = entry.length;
+
+	spin_lock_irqsave(&adapter->lock, flags);
+
+	if (!pciefb_desc_allowed(client, &desc)) {
+		ret = -EPERM;
+		goto out;
+	}
+	if (client->nr_present >= PCIEFB_PRESENT_DEPTH) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	i = client->nr_present;
+	while (i > 0 && ktime_after(client->present[i - 1].target, entry.target)) {
+		client->present[i] = client->present[i - 1];
+		i--;
+	}
+	client->present[i] = entry;
+	client->nr_present++;
+	client->present_queued++;
+
+out:
+	spin_unlock_irqrestore(&adapter->lock, flags);
+	return ret;
+}
+
+static bool pciefb_range_overlap(const struct pciefb_range *a,
+				 const struct pciefb_range *b)
+{
+	return (u64)a->offset < (u64)b->offset + b->length &&
+	       (u64)b->offset < (u64)a->offset + a->length;
+}
+
+// ranges are exclusive, a client can not claim what another one owns
+static int pciefb_claim(struct pciefb_client *client,
+			const struct pciefb_range *range)
+{
+	struct pcie_dev_adapter *adapter = client->adapter;
+	struct pciefb_client *other;
+	unsigned long flags;
+	int i, ret = 0;
+
+	if (!range->length ||
+	    (u64)range->offset + range->length > HOST_WINDOW_SIZE)
+		return -EINVAL;
+
+	spin_lock_irqsave(&adapter->lock, flags);
+
+	list_for_each_entry(other, &adapter->clients, node) {
+		for (i = 0; i < other->nr_ranges; i++) {
+			if (pciefb_range_overlap(range, &other->ranges[i])) {
+				ret = -EBUSY;
+				goto out;
+			}
+		}
+	}
+
+	if (client->nr_ranges >= PCIEFB_MAX_RANGES) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	client->ranges[client->nr_ranges++] = *range;
+
+out:
+	spin_unlock_irqrestore(&adapter->lock, flags);
+	return ret;
+}
+
+static int pciefb_unclaim(struct pciefb_client *client,
+			  const struct pciefb_range *range)
+{
+	struct pcie_dev_adapter *adapter = client->adapter;
+	unsigned long flags;
+	int i, ret = -ENOENT;
+
+	spin_lock_irqsave(&adapter->lock, flags);
+	for (i = 0; i < client->nr_ranges; i++) {
+		if (client->ranges[i].offset == range->offset &&
+		    client->ranges[i].length == range->length) {
+			client->ranges[i] = client->ranges[--client->nr_ranges];
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&adapter->lock, flags);
+
+	return ret;
+}
+
+static long pciefb_client_ioctl(struct file *file, unsigned int cmd,
+				unsigned long arg)
+{
+	struct pciefb_client *client = file->private_data;
+	void __user *argp = (void __user *)arg;
+	struct pciefb_range range;
+	struct pciefb_wait wait;
+	struct pciefb_present present;
+	u32 budget_us;
+
+	switch (cmd) {
+	case PCIEFB_IOC_CLAIM:
+		if (copy_from_user(&range, argp, sizeof(range)))
+			return -EFAULT;
+		return pciefb_claim(client, &range);
+
+	case PCIEFB_IOC_UNCLAIM:
+		if (copy_from_user(&range, argp, sizeof(range)))
+			return -EFAULT;
+		return pciefb_unclaim(client, &range);
+
+	case PCIEFB_IOC_WAIT:
+		if (copy_from_user(&wait, argp, sizeof(wait)))
+			return -EFAULT;
+		return pciefb_wait_done(client, &wait);
+
+	case PCIEFB_IOC_SET_POLL:
+		if (get_user(budget_us, (u32 __user *)argp))
+			return -EFAULT;
+		if (budget_us > PCIEFB_MAX_POLL_US)
+			return -EINVAL;
+		client->poll_budget_ns = (u64)budget_us * NSEC_PER_USEC;
+		return 0;
+
+	case PCIEFB_IOC_PRESENT:
+		if (copy_from_user(&present, argp, sizeof(present)))
+			return -EFAULT;
+		return pciefb_queue_present(client, &present);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations pciefb_client_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pciefb_client_open,
+	.release	= pciefb_client_release,
+	.mmap		= pciefb_client_mmap,
+	.poll		= pciefb_client_poll,
+	.unlocked_ioctl	= pciefb_client_ioctl,
+};
+
+
+
+
+
+static int pciefb_stats_show(struct seq_file *s, void *unused)
+{
+	struct pcie_dev_adapter *adapter = s->private;
+	struct pciefb_stats st;
+	unsigned long flags;
+	u64 elapsed_ns, avg_ns = 0;
+
+	spin_lock_irqsave(&adapter->lock, flags);
+	st = adapter->stats;
+	spin_unlock_irqrestore(&adapter->lock, flags);
+
+	elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), st.since));
+	if (!elapsed_ns)
+		elapsed_ns = 1;
+	if (st.xfer_count)
+		avg_ns = div64_u64(st.xfer_total_ns, st.xfer_count);
+
+	seq_printf(s, "mode:        %s\n", READ_ONCE(adapter->nr_clients) ?
+		   "queue" : (adapter->flag ? "cyclic" : "idle"));
+	seq_printf(s, "frames:      %llu\n", st.frames);
+	seq_printf(s, "frames/s:    %llu\n",
+		   mul_u64_u64_div_u64(st.frames, NSEC_PER_SEC, elapsed_ns));
+	seq_printf(s, "descriptors: %llu\n", st.descs);
+	seq_printf(s, "bytes:       %llu\n", st.bytes);
+	seq_printf(s, "bytes/s:     %llu\n",
+		   mul_u64_u64_div_u64(st.bytes, NSEC_PER_SEC, elapsed_ns));
+	seq_printf(s, "dma errors:  %llu\n", st.dma_errors);
+	seq_printf(s, "rejected:    %llu\n", st.rejected);
+	seq_printf(s, "xfer us:     last %llu min %llu avg %llu max %llu\n",
+		   div_u64(st.xfer_last_ns, NSEC_PER_USEC),
+		   div_u64(st.xfer_min_ns, NSEC_PER_USEC),
+		   div_u64(avg_ns, NSEC_PER_USEC),
+		   div_u64(st.xfer_max_ns, NSEC_PER_USEC));
+
+	return 0;
+}
+
+static int pciefb_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pciefb_stats_show, inode->i_private);
+}
+
+// writing 0 clears the counters
+static ssize_t pciefb_stats_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct pcie_dev_adapter *adapter = s->private;
+	unsigned long flags;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &val);
+	if (ret)
+		return ret;
+	if (val)
+		return -EINVAL;
+
+	spin_lock_irqsave(&adapter->lock, flags);
+	memset(&adapter->stats, 0, sizeof(adapter->stats));
+	adapter->stats.since = ktime_get();
+	spin_unlock_irqrestore(&adapter->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations pciefb_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pciefb_stats_open,
+	.read		= seq_read,
+	.write		= pciefb_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+// negotiated link against what the mode needs, both in Mb/s
+static int pciefb_link_show(struct seq_file *s, void *unused)
+{
+	struct pcie_dev_adapter *adapter = s->private;
+	struct pci_dev *pdev = adapter->pdev;
+	enum pci_bus_speed speed;
+	enum pcie_link_width width;
+	u32 avail, need;
+
+	avail = pcie_bandwidth_available(pdev, NULL, &speed, &width);
+	need = div_u64((u64)FRAME_SIZE * 8 * refresh_rate, 1000000);
+
+	seq_printf(s, "link:      %s x%d\n", pci_speed_string(speed), width);
+	seq_printf(s, "capable:   %s x%d\n",
+		   pci_speed_string(pcie_get_speed_cap(pdev)),
+		   pcie_get_width_cap(pdev));
+	seq_printf(s, "available: %u Mb/s\n", avail);
+	seq_printf(s, "required:  %u Mb/s (%dx%d %dbpp @ %u Hz)\n", need,
+		   IMAGE_WIDTH, IMAGE_HEIGHT, BITS_PER_PIX, refresh_rate);
+	if (need > avail)
+		seq_puts(s, "warning:   link is too slow for the mode\n");
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pciefb_link);
+
 
 
 
@@ -137,14 +1117,25 @@ static struct fb_fix_screeninfo pciefb_fix = {
 	.accel = FB_ACCEL_NONE,
 };
 
+static struct pcie_dev_adapter *fb_adapter(struct fb_info *info)
+{
+	return pci_get_drvdata(to_pci_dev(info->device));
+}
+
 static int fb_open(struct fb_info *info, int user)
 {
+	struct pcie_dev_adapter *adapter = fb_adapter(info);
+
 	printk("pciefb open\n");
-	if(g_adapter->flag == 0){
+	mutex_lock(&adapter->client_mutex);
+	if(adapter->flag == 0){
 		printk("start fb output\n");
-		dma_init();
-		g_adapter->flag = 1;
+		// queue clients own the engine, dma_init() runs when the last one goes
+		if(adapter->nr_clients == 0)
+			dma_init(adapter);
+		adapter->flag = 1;
 	}
+	mutex_unlock(&adapter->client_mutex);
 
 	
 	return 0;
@@ -158,13 +1149,120 @@ static int fb_release(struct fb_info *info, int user)
 }
 
 
+// console drawing into a cached window, write back the lines it touched
+static void fb_sync_lines(struct fb_info *info, u32 y, u32 height)
+{
+	if (y >= info->var.yres)
+		return;
+	if (height > info->var.yres - y)
+		height = info->var.yres - y;
+
+	pciefb_sync_for_device(fb_adapter(info), y * info->fix.line_length,
+			       height * info->fix.line_length);
+}
+
+static void fb_fillrect(struct fb_info *info, const struct fb_fillrect *rect)
+{
+	cfb_fillrect(info, rect);
+	fb_sync_lines(info, rect->dy, rect->height);
+}
+
+static void fb_copyarea(struct fb_info *info, const struct fb_copyarea *area)
+{
+	cfb_copyarea(info, area);
+	fb_sync_lines(info, area->dy, area->height);
+}
+
+static void fb_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+	cfb_imageblit(info, image);
+	fb_sync_lines(info, image->dy, image->height);
+}
+
+// write() on /dev/fb, write back what it stored like the drawing ops do
+static ssize_t fb_write(struct fb_info *info, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	ret = fb_sys_write(info, buf, count, ppos);
+	if (ret > 0)
+		pciefb_sync_for_device(fb_adapter(info), pos, ret);
+
+	return ret;
+}
+
+/*
+ * The whole host window can be mapped, not just smem_len, so submit clients
+ * can render into every range they may claim.
+ */
+static int fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	struct pcie_dev_adapter *adapter = fb_adapter(info);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (offset >= HOST_WINDOW_SIZE || size > HOST_WINDOW_SIZE - offset)
+		return -EINVAL;
+
+	if (!adapter->fb_streaming) {
+		// uncached on most non x86 hosts, that is what cached_mmap is for
+		vma->vm_pgoff += (adapter->cpu_ptr - adapter->cpu_ptr_unalign) >> PAGE_SHIFT;
+		return dma_mmap_coherent(&adapter->pdev->dev, vma,
+					 adapter->cpu_ptr_unalign,
+					 adapter->dma_ptr_unalign, DAM_BUFF_SIZE);
+	}
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       (adapter->fb_phys + offset) >> PAGE_SHIFT,
+			       size, vma->vm_page_prot);
+}
+
+// like DMA_BUF_IOCTL_SYNC, but on a byte range of the window
+static int fb_ioctl(struct fb_info *info, unsigned int cmd, unsigned long arg)
+{
+	struct pcie_dev_adapter *adapter = fb_adapter(info);
+	struct pciefb_sync sync;
+
+	if (cmd != PCIEFB_IOC_SYNC)
+		return -ENOTTY;
+
+	if (copy_from_user(&sync, (void __user *)arg, sizeof(sync)))
+		return -EFAULT;
+	if (sync.flags & ~PCIEFB_SYNC_VALID_FLAGS_MASK)
+		return -EINVAL;
+	if (!(sync.flags & PCIEFB_SYNC_RW))
+		return -EINVAL;
+
+	if (!sync.length) {
+		sync.offset = 0;
+		sync.length = info->fix.smem_len;
+	}
+	if ((u64)sync.offset + sync.length > HOST_WINDOW_SIZE)
+		return -EINVAL;
+
+	if (sync.flags & PCIEFB_SYNC_END) {
+		if (sync.flags & PCIEFB_SYNC_WRITE)
+			pciefb_sync_for_device(adapter, sync.offset, sync.length);
+	} else {
+		pciefb_sync_for_cpu(adapter, sync.offset, sync.length);
+	}
+
+	return 0;
+}
+
+
 static struct fb_ops pciefb_ops = {
-	.fb_fillrect = cfb_fillrect,
-	.fb_copyarea = cfb_copyarea,
-	.fb_imageblit = cfb_imageblit,
+	.fb_fillrect = fb_fillrect,
+	.fb_copyarea = fb_copyarea,
+	.fb_imageblit = fb_imageblit,
+	.fb_write	= fb_write,
 	.owner		= THIS_MODULE,
 	.fb_open	= fb_open,
 	.fb_release = fb_release,
+	.fb_mmap	= fb_mmap,
+	.fb_ioctl	= fb_ioctl,
 };
 
 struct fb_info * fb_init(struct device *dev, void *fbmem_virt,unsigned long phy_start)
@@ -262,6 +1360,148 @@ error0:
 }
 
 
+/*
+ * The host window has to be AXI_BAR_ALIGN_SIZE aligned. The 8MB coherent
+ * buffer is too big for the page allocator and comes out of CMA, which
+ * does not care about the device's node. So on a numa host take one
+ * naturally aligned block from the device's node and map it for streaming,
+ * every path that hands it to the engine syncs it first. Without numa_local
+ * it is the coherent pool, dma_alloc_coherent() still prefers the node.
+ */
+static int pciefb_alloc_host(struct pcie_dev_adapter *adapter)
+{
+	struct device *dev = &adapter->pdev->dev;
+	unsigned int order = get_order(HOST_WINDOW_SIZE);
+	struct page *page;
+	dma_addr_t dma_ptr;
+	void *cpu_ptr;
+
+	if (numa_local && adapter->node != NUMA_NO_NODE) {
+		page = alloc_pages_node(adapter->node, GFP_KERNEL | __GFP_THISNODE |
+					__GFP_ZERO | __GFP_NOWARN, order);
+		if (page) {
+			dma_ptr = dma_map_page(dev, page, 0, HOST_WINDOW_SIZE,
+					       DMA_TO_DEVICE);
+			if (!dma_mapping_error(dev, dma_ptr) &&
+			    !(dma_ptr & (AXI_BAR_ALIGN_SIZE - 1))) {
+				adapter->fb_page = page;
+				adapter->fb_streaming = 1;
+				adapter->dma_ptr = dma_ptr;
+				adapter->cpu_ptr = page_address(page);
+				adapter->fb_phys = page_to_phys(page);
+				adapter->fb_node = page_to_nid(page);
+				return 0;
+			}
+			if (!dma_mapping_error(dev, dma_ptr))
+				dma_unmap_page(dev, dma_ptr, HOST_WINDOW_SIZE,
+					       DMA_TO_DEVICE);
+			__free_pages(page, order);
+		}
+		dev_info(dev, "no aligned block on node %d, use the coherent pool\n",
+			 adapter->node);
+	}
+
+	if (cached_mmap) {
+		cpu_ptr = dma_alloc_noncoherent(dev, DAM_BUFF_SIZE, &dma_ptr,
+						DMA_TO_DEVICE, GFP_KERNEL);
+		adapter->fb_noncoherent = adapter->fb_streaming = !!cpu_ptr;
+	} else {
+		cpu_ptr = dma_alloc_coherent(dev,DAM_BUFF_SIZE, &dma_ptr,
+					     GFP_KERNEL);
+	}
+	if (!cpu_ptr)
+		return -ENOMEM;
+
+	memset(cpu_ptr,0,DAM_BUFF_SIZE);
+	adapter->dma_ptr = dma_ptr & ( ~((dma_addr_t) (AXI_BAR_ALIGN_SIZE -1)) ) ;
+	if( (dma_ptr & ((dma_addr_t) (AXI_BAR_ALIGN_SIZE -1))  ) != 0)
+		adapter->dma_ptr += AXI_BAR_ALIGN_SIZE;
+	
+	adapter->cpu_ptr = cpu_ptr + adapter->dma_ptr - dma_ptr;
+	
+	adapter->dma_ptr_unalign = dma_ptr;
+	adapter->cpu_ptr_unalign = cpu_ptr;
+	// noncoherent memory is in the linear map, it is mmapped by pfn
+	adapter->fb_phys = adapter->fb_noncoherent ?
+			   virt_to_phys(adapter->cpu_ptr) : adapter->dma_ptr;
+	pciefb_sync_for_device(adapter, 0, HOST_WINDOW_SIZE);
+	adapter->fb_node = page_to_nid(is_vmalloc_addr(cpu_ptr) ?
+				       vmalloc_to_page(cpu_ptr) :
+				       virt_to_page(cpu_ptr));
+
+	printk("      dma memory PHY addr 0x%llx, virtual addr 0x%llx\n",dma_ptr,cpu_ptr);
+
+	return 0;
+}
+
+static void pciefb_free_host(struct pcie_dev_adapter *adapter)
+{
+	struct device *dev = &adapter->pdev->dev;
+
+	if (adapter->fb_page) {
+		dma_unmap_page(dev, adapter->dma_ptr, HOST_WINDOW_SIZE,
+			       DMA_TO_DEVICE);
+		__free_pages(adapter->fb_page, get_order(HOST_WINDOW_SIZE));
+		return;
+	}
+
+	if (adapter->fb_noncoherent) {
+		dma_free_noncoherent(dev, DAM_BUFF_SIZE, adapter->cpu_ptr_unalign,
+				     adapter->dma_ptr_unalign, DMA_TO_DEVICE);
+		return;
+	}
+
+	dma_free_coherent(dev,DAM_BUFF_SIZE, adapter->cpu_ptr_unalign,
+			  adapter->dma_ptr_unalign);
+}
+
+static ssize_t dev_node_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct pcie_dev_adapter *adapter = pci_get_drvdata(to_pci_dev(dev));
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", adapter->node);
+}
+
+static ssize_t fb_node_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct pcie_dev_adapter *adapter = pci_get_drvdata(to_pci_dev(dev));
+
+	return scnprintf(buf, PAGE_SIZE, "%d %s %s\n", adapter->fb_node,
+			 adapter->fb_page ? "node-local" : "dma-pool",
+			 adapter->fb_streaming ? "cached" : "coherent");
+}
+
+static ssize_t irq_cpus_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct pcie_dev_adapter *adapter = pci_get_drvdata(to_pci_dev(dev));
+
+	if (adapter->node == NUMA_NO_NODE)
+		return scnprintf(buf, PAGE_SIZE, "any\n");
+
+	return scnprintf(buf, PAGE_SIZE, "%*pbl\n",
+			 cpumask_pr_args(cpumask_of_node(adapter->node)));
+}
+
+static DEVICE_ATTR(dev_node, S_IRUGO, dev_node_show, NULL);
+static DEVICE_ATTR(fb_node, S_IRUGO, fb_node_show, NULL);
+static DEVICE_ATTR(irq_cpus, S_IRUGO, irq_cpus_show, NULL);
+
+static struct attribute *pcie_attrs[] = {
+	&dev_attr_dev_node.attr,
+	&dev_attr_fb_node.attr,
+	&dev_attr_irq_cpus.attr,
+	NULL,
+};
+
+static struct attribute_group pcie_group = {
+	.attrs = pcie_attrs,
+	.name = "pciefb",
+};
+
+
 void release_fb(struct fb_info *info)
 {
 
@@ -281,17 +1521,18 @@ static int test_pcidev_probe(struct pci_dev *pdev,
 	int ret,result = -1;
 	struct pcie_dev_adapter *adapter;
 	u8 __iomem *address;
-	void *cpu_ptr = NULL;
 	unsigned int *buf32,i;
-	dma_addr_t dma_ptr;
+	char name[32];
 
 	printk("test pcie device probe\n");
 
-	adapter = devm_kzalloc(&pdev->dev, sizeof(struct pcie_dev_adapter),
-			      GFP_KERNEL);
+	// the submit clients hold it past remove
+	adapter = kzalloc_node(sizeof(struct pcie_dev_adapter), GFP_KERNEL,
+			       dev_to_node(&pdev->dev));
 	if(!adapter){
 		return -ENOMEM;
 	}
+	kref_init(&adapter->ref);
 	
 	pci_set_master(pdev);
 	
@@ -359,66 +1600,111 @@ static int test_pcidev_probe(struct pci_dev *pdev,
 	
 		
 
-	cpu_ptr = dma_alloc_coherent(&pdev->dev,DAM_BUFF_SIZE, &dma_ptr,
-				     GFP_KERNEL);
-	if (!cpu_ptr) {
+	adapter->pdev = pdev;
+	adapter->node = dev_to_node(&pdev->dev);
+
+	if (pciefb_alloc_host(adapter)) {
 	
 		dev_warn(&pdev->dev,"dma alloc failed\n");
 		ret = -ENOMEM;
 		goto dma_err;
 	}
 	
-
-	memset(cpu_ptr,0,DAM_BUFF_SIZE);
-	adapter->dma_ptr = dma_ptr & ( ~((dma_addr_t) (AXI_BAR_ALIGN_SIZE -1)) ) ;
-	if( (dma_ptr & ((dma_addr_t) (AXI_BAR_ALIGN_SIZE -1))  ) != 0)
-		adapter->dma_ptr += AXI_BAR_ALIGN_SIZE;
-	
-	
-	adapter->cpu_ptr = cpu_ptr + adapter->dma_ptr - dma_ptr;
-	
-	adapter->dma_ptr_unalign = dma_ptr;
-	adapter->cpu_ptr_unalign = cpu_ptr;
-	
 	
-	adapter->pdev = pdev;
 	adapter->mem_space_addr = address;
 	adapter->mem_space_length = bar_length;
 	adapter->flag = 0;
 
-	printk("      dma memory PHY addr 0x%llx, virtual addr 0x%llx\n",dma_ptr,cpu_ptr);
 	printk("fixed dma memory PHY addr 0x%llx, virtual addr 0x%llx\n",adapter->dma_ptr,(dma_addr_t)adapter->cpu_ptr);
-	
-	g_adapter = adapter;
+	dev_info(&pdev->dev, "device on node %d, frame buffer on node %d\n",
+		 adapter->node, adapter->fb_node);
 	
 	pci_set_drvdata(pdev, adapter);
 
+	spin_lock_init(&adapter->lock);
+	mutex_init(&adapter->client_mutex);
+	INIT_LIST_HEAD(&adapter->clients);
+	hrtimer_init(&adapter->frame_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	adapter->frame_timer.function = pciefb_frame_tick;
+	adapter->frame_period = ns_to_ktime(NSEC_PER_SEC /
+					    (refresh_rate ? refresh_rate : 60));
+	adapter->stats.since = ktime_get();
+
+	if (!pci_enable_msi(pdev)){
+		printk("enable MSI interrupt\n");
+	}
+	else
+		printk("enable MSI interrupt failed\n");
 
-	//misc_register(&poll_dev); 
-	//if(sysfs_create_group(&poll_dev.this_device->kobj, &pcie_group) != 0)
-	//{
-	//	printk("create %s sys-file err \n",pcie_group.name);
-	//}	
+	ret = request_irq(pdev->irq,
+			  dma_isr,
+			  IRQF_SHARED, DRIVER_NAME, adapter);
+	if(ret){
+		printk("request IRQ %d,error %d\n",pdev->irq,ret);
+		result = ret;
+		goto irq_err;
+	}
+	// completions are handled next to the frame buffer and the rings
+	if (adapter->node != NUMA_NO_NODE)
+		irq_set_affinity_hint(pdev->irq, cpumask_of_node(adapter->node));
 
-	adapter->fb_info = fb_init(&pdev->dev,adapter->cpu_ptr,adapter->dma_ptr);
+	adapter->fb_info = fb_init(&pdev->dev,adapter->cpu_ptr,adapter->fb_phys);
 	
+	adapter->id = ida_alloc(&pciefb_ida, GFP_KERNEL);
+	if(adapter->id < 0){
+		result = adapter->id;
+		goto misc_err;
+	}
+	snprintf(adapter->submit_name, sizeof(adapter->submit_name),
+		 "pciefb_submit%d", adapter->id);
+	adapter->submit_dev.minor = MISC_DYNAMIC_MINOR;
+	adapter->submit_dev.name = adapter->submit_name;
+	adapter->submit_dev.fops = &pciefb_client_fops;
+	adapter->submit_dev.parent = &pdev->dev;
+
+	ret = misc_register(&adapter->submit_dev);
+	if(ret){
+		dev_err(&pdev->dev, "can not register %s\n", adapter->submit_name);
+		ida_free(&pciefb_ida, adapter->id);
+		result = ret;
+		goto misc_err;
+	}
 	
+	snprintf(name, sizeof(name), DRIVER_NAME "%d", adapter->id);
+	adapter->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("stats", 0644, adapter->debugfs, adapter,
+			    &pciefb_stats_fops);
+	debugfs_create_file("link", 0444, adapter->debugfs, adapter,
+			    &pciefb_link_fops);
+
+	if(sysfs_create_group(&pdev->dev.kobj, &pcie_group) != 0)
+	{
+		printk("create %s sys-file err \n",pcie_group.name);
+	}
+
 	// dma_init();
 	
 	
 	return 0;
-	
+
+misc_err:
+	if(adapter->fb_info)
+		release_fb(adapter->fb_info);
+	irq_set_affinity_hint(pdev->irq, NULL);
+	free_irq(pdev->irq,adapter);
+irq_err:
+	pci_disable_msi(pdev);
+	pciefb_free_host(adapter);
 dma_err:
 	
 	pci_release_selected_regions(pdev,pci_select_bars(pdev,
 						     IORESOURCE_MEM));
-	free_irq(pdev->irq,pdev);
-	pci_disable_msi(pdev);
 						     
 disable_device:
 	pci_disable_device(pdev);
 
 return_error:	
+	pciefb_adapter_put(adapter);
 	
 	return result;
 	
@@ -431,26 +1717,52 @@ static void test_pcidev_remove(struct pci_dev *pdev)
 	struct pcie_dev_adapter *adapter = pci_get_drvdata(pdev);
 
 	
-	dma_stop();
+	struct pciefb_client *client;
+	unsigned long flags;
+
+	
+	sysfs_remove_group(&pdev->dev.kobj, &pcie_group);
+	debugfs_remove_recursive(adapter->debugfs);
+	misc_deregister(&adapter->submit_dev);
+
+	// open clients stay until they close, detach them from the engine
+	mutex_lock(&adapter->client_mutex);
+	spin_lock_irqsave(&adapter->lock, flags);
+	adapter->gone = 1;
+	spin_unlock_irqrestore(&adapter->lock, flags);
+	mutex_unlock(&adapter->client_mutex);
+
+	// a tick past this point submits nothing
+	hrtimer_cancel(&adapter->frame_timer);
+
+	dma_stop(adapter);
+	irq_set_affinity_hint(pdev->irq, NULL);
+	free_irq(pdev->irq,adapter);
+
+	spin_lock_irqsave(&adapter->lock, flags);
+	adapter->busy = 0;
+	adapter->inflight = NULL;
+	list_for_each_entry(client, &adapter->clients, node)
+		wake_up_interruptible(&client->wait);
+	spin_unlock_irqrestore(&adapter->lock, flags);
+
 	// devm_ioremap_release(&pdev->dev,adapter->mem_space_addr);
 	if(adapter->fb_info){
 		release_fb(adapter->fb_info);
 	}
 	
-	dma_free_coherent(&pdev->dev,DAM_BUFF_SIZE, adapter->cpu_ptr_unalign,
-			  adapter->dma_ptr_unalign);
+	pciefb_free_host(adapter);
 				  
 	pci_release_selected_regions(pdev,pci_select_bars(pdev,
 						     IORESOURCE_MEM));
 						     
 		
-	// free_irq(pdev->irq,pdev);	
 	pci_disable_msi(pdev);
 				     
 	pci_disable_device(pdev);
 	
-	//sysfs_remove_group(&poll_dev.this_device->kobj, &pcie_group);
-	// free(adapter);
+	ida_free(&pciefb_ida, adapter->id);
+	pciefb_adapter_put(adapter);
 	
 	//misc_deregister(&poll_dev);
 }	
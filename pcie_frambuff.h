@@ -0,0 +1,119 @@
+#ifndef __PCIE_FRAMBUFF_H
+#define __PCIE_FRAMBUFF_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * user interface of the pciefb_submit<n> misc device, one per card
+ *
+ * A client mmaps one page at offset 0, that is struct pciefb_ring. It fills
+ * desc[tail % PCIEFB_RING_ENTRIES] and then increments tail, that is the
+ * doorbell, no syscall is needed. The driver picks up new entries at every
+ * frame boundary, checks them against the ranges the client claimed with
+ * PCIEFB_IOC_CLAIM and writes the result back into desc[].status and done.
+ *
+ * The card gives the driver no scanout timing, so a frame boundary is a tick
+ * of a free running CLOCK_MONOTONIC timer at the refresh_rate module
+ * parameter. It starts with the first open and keeps its phase until the
+ * last close, it is not locked to the display's vertical blank.
+ */
+
+#define PCIEFB_RING_ENTRIES 128
+#define PCIEFB_PRESENT_ENTRIES 16
+
+#define PCIEFB_DESC_PENDING	0
+#define PCIEFB_DESC_DONE	1
+#define PCIEFB_DESC_EPERM	2	/* source range not owned by the client */
+#define PCIEFB_DESC_EINVAL	3	/* bad length or destination */
+#define PCIEFB_DESC_EIO		4	/* dma engine reported an error */
+#define PCIEFB_PRESENT_SKIPPED	5	/* a newer frame was due at the same boundary */
+
+struct pciefb_sub_desc {
+	__u32 src_offset;	/* offset in the host frame buffer */
+	__u32 dst_offset;	/* offset in the card frame memory */
+	__u32 length;
+	__u32 status;		/* written by the driver */
+};
+
+/* result of a PCIEFB_IOC_PRESENT, times are CLOCK_MONOTONIC */
+struct pciefb_present_done {
+	__u32 id;
+	__u32 status;
+	__u64 target_ns;
+	__u64 present_ns;	/* dma into card memory completed, 0 if not sent */
+};
+
+struct pciefb_ring {
+	__u32 tail;		/* written by the client */
+	__u32 head;		/* written by the driver, entries consumed */
+	__u32 done;		/* written by the driver, entries completed */
+	__u32 present_done;	/* written by the driver, present[] results */
+	__u32 present_read;	/* written by the client, present[] results consumed */
+	__u32 reserved[11];
+	struct pciefb_sub_desc desc[PCIEFB_RING_ENTRIES];
+	struct pciefb_present_done present[PCIEFB_PRESENT_ENTRIES];
+};
+
+struct pciefb_range {
+	__u32 offset;
+	__u32 length;
+};
+
+/*
+ * wait until ring->done reaches seq. If a poll budget was set with
+ * PCIEFB_IOC_SET_POLL (in us, at most 10, 0 turns it off) the caller busy
+ * polls the status of its own descriptor for that long before it sleeps on
+ * the interrupt.
+ */
+struct pciefb_wait {
+	__u32 seq;
+	__u32 timeout_ms;
+};
+
+/*
+ * queue a frame from a claimed range for a CLOCK_MONOTONIC target time.
+ * It is sent at the frame boundary nearest to target_ns, the result shows
+ * up in ring->present[(present_done - 1) % PCIEFB_PRESENT_ENTRIES].
+ * present_ns is when the copy into card memory completed, the display
+ * shows the frame at its next scanout after that, which the driver can not
+ * see.
+ * poll() reports POLLIN while present_done is ahead of present_read, or
+ * once every descriptor and present of the client is done.
+ */
+struct pciefb_present {
+	__u32 id;		/* echoed back in pciefb_present_done */
+	__u32 src_offset;
+	__u32 length;		/* 0 for a full frame */
+	__u32 reserved;
+	__u64 target_ns;
+};
+
+/*
+ * fb ioctl, in the style of DMA_BUF_IOCTL_SYNC. With a cached host window
+ * (fb_node in sysfs says "cached") a writer brackets its drawing with
+ * START and END|WRITE on the damaged range, length 0 is the whole frame.
+ * Descriptors from the submit queue are written back by the driver.
+ */
+struct pciefb_sync {
+	__u64 flags;
+	__u32 offset;
+	__u32 length;
+};
+
+#define PCIEFB_SYNC_READ	(1 << 0)
+#define PCIEFB_SYNC_WRITE	(2 << 0)
+#define PCIEFB_SYNC_RW		(PCIEFB_SYNC_READ | PCIEFB_SYNC_WRITE)
+#define PCIEFB_SYNC_START	(0 << 2)
+#define PCIEFB_SYNC_END		(1 << 2)
+#define PCIEFB_SYNC_VALID_FLAGS_MASK (PCIEFB_SYNC_RW | PCIEFB_SYNC_END)
+
+#define PCIEFB_IOC_MAGIC	'P'
+#define PCIEFB_IOC_CLAIM	_IOW(PCIEFB_IOC_MAGIC, 1, struct pciefb_range)
+#define PCIEFB_IOC_UNCLAIM	_IOW(PCIEFB_IOC_MAGIC, 2, struct pciefb_range)
+#define PCIEFB_IOC_WAIT		_IOW(PCIEFB_IOC_MAGIC, 3, struct pciefb_wait)
+#define PCIEFB_IOC_SET_POLL	_IOW(PCIEFB_IOC_MAGIC, 4, __u32)
+#define PCIEFB_IOC_PRESENT	_IOW(PCIEFB_IOC_MAGIC, 5, struct pciefb_present)
+#define PCIEFB_IOC_SYNC		_IOW(PCIEFB_IOC_MAGIC, 6, struct pciefb_sync)
+
+#endif
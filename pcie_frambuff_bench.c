@@ -0,0 +1,209 @@
+/*
+ * host to card throughput benchmark for pcie_frambuff
+ *
+ * gcc -O2 -Wall -o pcie_frambuff_bench pcie_frambuff_bench.c
+ *
+ * It pushes frames through the pciefb_submit descriptor queue, sweeping
+ * the frame size and the descriptor chunk size, and prints the achieved
+ * H2C GB/s. The driver telemetry is in /sys/kernel/debug/test_pcie0/.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "pcie_frambuff.h"
+
+#define FRAME_BYTES (1280 * 720 * 4)
+
+static const uint32_t frame_sizes[] = {
+	256 * 1024, 1024 * 1024, 2 * 1024 * 1024, FRAME_BYTES,
+};
+
+static const uint32_t chunk_sizes[] = {
+	16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, FRAME_BYTES,
+};
+
+static volatile struct pciefb_ring *ring;
+static int fd;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int wait_seq(uint32_t seq)
+{
+	struct pciefb_wait wait = {
+		.seq = seq,
+		.timeout_ms = 1000,
+	};
+
+	if (ioctl(fd, PCIEFB_IOC_WAIT, &wait) < 0) {
+		perror("PCIEFB_IOC_WAIT");
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t tail, first;
+static int errors;
+
+static int submit(uint32_t off, uint32_t len)
+{
+	uint32_t i;
+
+	while (tail - ring->done >= PCIEFB_RING_ENTRIES) {
+		if (wait_seq(tail - PCIEFB_RING_ENTRIES + 1))
+			return -1;
+	}
+
+	i = tail % PCIEFB_RING_ENTRIES;
+	// the slot is complete, check it before it is reused
+	if (tail - first >= PCIEFB_RING_ENTRIES &&
+	    ring->desc[i].status != PCIEFB_DESC_DONE)
+		errors++;
+
+	ring->desc[i].src_offset = off;
+	ring->desc[i].dst_offset = off;
+	ring->desc[i].length = len;
+	ring->desc[i].status = PCIEFB_DESC_PENDING;
+	__sync_synchronize();
+	ring->tail = ++tail;
+
+	return 0;
+}
+
+/*
+ * Queue frames * (frame / chunk) descriptors, keeping the ring as full as
+ * possible so the driver chains them back to back. The clock starts when
+ * the first descriptor completes, so the wait for the first frame tick is
+ * not counted, and neither are the bytes of that descriptor.
+ */
+static int run(uint32_t frame, uint32_t chunk, int frames, double *gbps,
+	       double *frame_us)
+{
+	uint64_t total = (uint64_t)frame * frames;
+	uint64_t queued = 0, t0 = 0, t1;
+	uint32_t len, off, i;
+
+	first = tail;
+	errors = 0;
+
+	while (queued < total) {
+		off = queued % frame;
+		len = frame - off < chunk ? frame - off : chunk;
+		if (submit(off, len))
+			return -1;
+		queued += len;
+
+		if (!t0 && (tail - first == PCIEFB_RING_ENTRIES || queued == total)) {
+			if (wait_seq(first + 1))
+				return -1;
+			t0 = now_ns();
+		}
+	}
+
+	if (wait_seq(tail))
+		return -1;
+	t1 = now_ns();
+
+	// the slots submit() did not reuse
+	for (i = tail - PCIEFB_RING_ENTRIES; i != tail; i++) {
+		if ((int32_t)(i - first) < 0)
+			continue;
+		if (ring->desc[i % PCIEFB_RING_ENTRIES].status != PCIEFB_DESC_DONE)
+			errors++;
+	}
+
+	total -= chunk < frame ? chunk : frame;
+	*gbps = t1 > t0 ? (double)total / (t1 - t0) : 0;
+	*frame_us = total ? (double)(t1 - t0) / 1000 * frame / total : 0;
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d device] [-n frames] [-p poll_us]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = "/dev/pciefb_submit0";
+	struct pciefb_range range = { 0, FRAME_BYTES };
+	uint32_t poll_us = 0;
+	int frames = 120;
+	double gbps, frame_us;
+	unsigned int i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:p:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'p':
+			poll_us = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+
+	ring = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	tail = ring->tail;
+
+	if (ioctl(fd, PCIEFB_IOC_CLAIM, &range) < 0) {
+		perror("PCIEFB_IOC_CLAIM");
+		return 1;
+	}
+	if (ioctl(fd, PCIEFB_IOC_SET_POLL, &poll_us) < 0) {
+		perror("PCIEFB_IOC_SET_POLL");
+		return 1;
+	}
+
+	printf("%10s %10s %10s %12s %8s\n",
+	       "frame", "chunk", "GB/s", "us/frame", "errors");
+
+	for (i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+		for (j = 0; j < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); j++) {
+			if (chunk_sizes[j] > frame_sizes[i])
+				continue;
+			if (run(frame_sizes[i], chunk_sizes[j], frames,
+				&gbps, &frame_us))
+				return 1;
+			printf("%10u %10u %10.3f %12.1f %8d\n", frame_sizes[i],
+			       chunk_sizes[j], gbps, frame_us, errors);
+		}
+	}
+
+	close(fd);
+	return 0;
+}
@@ -10,7 +10,32 @@
 #include <linux/clk.h>
 #include <linux/interrupt.h>
 #include <linux/hrtimer.h>
+#include <linux/timer.h>
 #include <linux/jiffies.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/idr.h>
+#include <linux/math64.h>
+#include <linux/seqlock.h>
+#include <linux/clocksource.h>
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
+#include <linux/pps_kernel.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/kfifo_buf.h>
+#include <linux/kfifo.h>
+#include <linux/slab.h>
+#include <linux/eventfd.h>
+
+#include "tc_capture.h"
 
 
 #define TC_CCR_CLKEN (0x1u << 0) /**< \brief (TC_CCR) Counter Clock Enable Command */
@@ -280,6 +305,8 @@
 #define TC_QISR_QERR (0x1u << 2) /**< \brief (TC_QISR) Quadrature Error */
 #define TC_QISR_MPE (0x1u << 3) /**< \brief (TC_QISR) Consecutive Missing Pulse Error */
 #define TC_QISR_DIR (0x1u << 8) /**< \brief (TC_QISR) Direction */
+/* -------- TC_QSR : (TC Offset: 0xDC) QDEC Status Register -------- */
+#define TC_QSR_DIR (0x1u << 8) /**< \brief (TC_QSR) Direction */
 /* -------- TC_FMR : (TC Offset: 0xD8) Fault Mode Register -------- */
 #define TC_FMR_ENCF0 (0x1u << 0) /**< \brief (TC_FMR) Enable Compare Fault Channel 0 */
 #define TC_FMR_ENCF1 (0x1u << 1) /**< \brief (TC_FMR) Enable Compare Fault Channel 1 */
@@ -320,33 +347,210 @@
 
 
 
+#define TC_MAX_CHANNELS 3
+#define MAX_BUFF_COUNT 5
+#define TC_NR_CLOCKS TC_CAPTURE_CLOCKS
+
+struct capture_data;
+
+// accumulators behind struct tc_capture_stats
+struct tc_stats {
+	u64 count;
+	u64 overruns;
+	u64 min;			/* ns, as everything below */
+	u64 max;
+	u64 sum_period;
+	u64 sum_high;
+	u64 sum_duty;			/* periods that have a high time */
+	u64 ref;			/* first period, the deviations are from it */
+	u64 prev;
+	s64 sum_d;
+	u64 sum_d2;			/* saturates */
+	u32 reranges;
+	u64 jitter[TC_CAPTURE_JITTER_BINS];
+};
+
+// the latest measurement of a channel, also under stats_seq
+struct tc_result {
+	u64 period;			/* ns, 0 no signal */
+	u64 high;			/* ns, TC_HIGH_UNKNOWN for a gate */
+	u64 mono;			/* CLOCK_MONOTONIC it was taken at */
+	u64 seq;			/* results published so far */
+};
+
+struct tc_channel {
+	struct capture_data *tc;
+	void __iomem *regs;		/* TC base + 0x40 * id */
+	u32 id;
+	int capture_done;
+	u32 buf_counter;
+	u32 buf_a[MAX_BUFF_COUNT];
+	u32 buf_b[MAX_BUFF_COUNT];
+	wait_queue_head_t wait;
+	int state;
+	unsigned int interval_ms;	/* TC_PERIODIC, a burst every interval */
+	struct hrtimer periodic_timer;
+
+	struct mutex lock;		/* state changes from sysfs and the stream device */
+	char name[32];
+	struct miscdevice miscdev;
+	atomic_t stream_users;
+	struct mutex read_lock;
+	wait_queue_head_t stream_wait;
+	struct tc_capture_ring *ring;	/* header page, the samples follow */
+	struct tc_capture_sample *samples;
+	u32 ring_mask;
+	size_t ring_size;
+	u32 discard;
+	u64 ra_pending;			/* RA read from RAB, its RB not yet */
+	bool have_ra;
+	u32 ovf;			/* COVFS since the last falling edge */
+
+	u32 clksel;			/* TIMER_CLOCK1..5 as 0..4, of the samples pushed now */
+	bool autorange;
+	u32 settle;			/* samples left that straddle a clock change */
+	int range_vote;			/* 1 slower, -1 faster */
+	u32 range_count;		/* periods in a row with that vote */
+	u32 range_pos;			/* dma word where a clock change lands */
+	u32 range_next;
+
+	int gate_id;			/* channel that counts our TIOA on its XC, -1 none */
+	bool gated;			/* the stream counts edges over gates */
+	bool mode_pending;
+	u32 mode_votes;
+	struct work_struct mode_work;	/* switches between capture and gated */
+	struct hrtimer gate_timer;
+	ktime_t gate_time;
+	u32 gate_cv;
+	bool gate_first;
+
+	u64 edge_ns;			/* CLOCK_MONOTONIC of the last falling edge */
+	u64 anchor_ns;			/* falling edge dated at irq entry, 0 none */
+	s64 real_offs;			/* CLOCK_REALTIME - CLOCK_MONOTONIC */
+	s64 raw_offs;			/* CLOCK_MONOTONIC_RAW - CLOCK_MONOTONIC */
+	bool pps_source;		/* in microchip,pps-channels */
+	struct pps_device *pps;
+	struct iio_dev *iio;
+	bool iio_on;			/* the iio buffer owns the stream */
+	struct list_head measures;	/* pending tc_measure, under stats_lock */
+	struct mutex measure_lock;
+	bool measure_stream;		/* the requests started the stream */
+	struct work_struct measure_work;
+
+	spinlock_t stats_lock;		/* writers, readers use stats_seq */
+	seqcount_spinlock_t stats_seq;
+	struct tc_stats stats;
+	struct tc_result result;
+
+	struct dma_chan *dma_chan;	/* NULL, the stream is read by the irq */
+	u32 *dma_buf;
+	dma_addr_t dma_addr;
+	u32 dma_words;
+	u32 dma_pos;			/* next RAB word to move into the ring */
+	dma_cookie_t dma_cookie;
+};
+
+#define TC_QDEC_EVENTS 64
+
+// channels 0 and 1 as quadrature decoder, position on 0, index on 1
+struct tc_qdec {
+	struct capture_data *tc;
+	char name[32];
+	struct miscdevice miscdev;
+	u32 filter;			/* TC_BMR MAXFILT */
+	DECLARE_KFIFO(events, struct tc_qdec_event, TC_QDEC_EVENTS);
+	bool lost;
+	struct mutex read_lock;
+	wait_queue_head_t wait;
+
+	struct mutex speed_lock;	/* position and time of the last speed read */
+	s32 speed_pos;
+	u64 speed_ns;
+	s64 speed;
+};
+
 struct capture_data {
 	void __iomem *base;
+	phys_addr_t phys_base;
+	struct device *dev;
 	u32 opmode;
 	struct clk *clk;
 	unsigned long clk_rate;
-	int irq;
-	int capture_done;
-	u32 buf_counter;
-	u32 frequency;
-	u32 duty;
-	int state;
+	u32 clock_hz[TC_NR_CLOCKS];
+	u32 clock_mult[TC_NR_CLOCKS];	/* ticks to ns */
+	u32 clock_shift[TC_NR_CLOCKS];
+	int id;				/* instance, tc_capture<id>.<channel> */
+	int irq[TC_MAX_CHANNELS];
+	int nr_irqs;			/* 1, the channels share the TC interrupt */
+	u32 channels;			/* mask of the channels in use */
+	struct tc_channel ch[TC_MAX_CHANNELS];
+	struct tc_qdec *qdec;		/* NULL, no microchip,qdec */
+	char measure_name[32];
+	struct miscdevice measure_dev;
+
+	// open files and mappings outlive remove, the rings go with the last
+	struct kref ref;
+	bool gone;			/* removed, nothing starts any more */
 };
 
+#define for_each_tc_channel(ddata, ch) \
+	for ((ch) = (ddata)->ch; (ch) < (ddata)->ch + TC_MAX_CHANNELS; (ch)++) \
+		if (!((ddata)->channels & BIT((ch) - (ddata)->ch))) {} else
 
-static DECLARE_WAIT_QUEUE_HEAD(tc_wait);  
 
-#define MAX_BUFF_COUNT 5
+static DEFINE_IDA(tc_ida);
+
 #define debug_print printk
-#define CHANNEL_0 0
 
+#define TC_PERIODIC 3
+#define TC_STREAMING 2
 #define TC_RUNNING 1
 #define TC_IDLE 0
 
+static unsigned int ring_entries = 65536;
+module_param(ring_entries, uint, 0444);
+MODULE_PARM_DESC(ring_entries, "samples in each channel's stream ring, rounded up to a power of two");
+
+static bool use_dma = true;
+module_param(use_dma, bool, 0444);
+MODULE_PARM_DESC(use_dma, "stream TC_RAB with the channel's rx dma when the device tree has one");
+
+static unsigned int dma_period = 256;
+module_param(dma_period, uint, 0444);
+MODULE_PARM_DESC(dma_period, "samples per dma period, one interrupt each");
+
+// cyclic buffer of the dma stream, in periods
+#define TC_DMA_PERIODS 4
+// position reads around the anchor before the callback takes what it has
+#define TC_DMA_ANCHOR_TRIES 4
+
+// status reads per irq before the handler gives the cpu back
+#define TC_DRAIN_BUDGET 64
+
+// periods in a row that have to ask for the same clock change
+#define TC_RANGE_VOTES 8
+#define TC_RANGE_NONE U32_MAX
+
+// TIMER_CLOCK1..4 divide the peripheral clock, TIMER_CLOCK5 is the slow clock
+static const u32 tc_clock_div[TC_NR_CLOCKS - 1] = { 2, 8, 32, 128 };
+
+static unsigned int gate_hz = 250000;
+module_param(gate_hz, uint, 0644);
+MODULE_PARM_DESC(gate_hz, "input frequency above which a stream counts edges over a gate, 0 never");
 
-u32 buf_a[MAX_BUFF_COUNT];
-u32 buf_b[MAX_BUFF_COUNT];
-// struct capture_data *g_data;
+static unsigned int gate_ms = 100;
+module_param(gate_ms, uint, 0644);
+MODULE_PARM_DESC(gate_ms, "gate time of the gated counting");
+
+#ifdef TC_CAPTURE_SIM
+#include "tc_capture_sim.h"
+#endif
+
+// gates in a row below gate_hz / 2 before capture takes over again
+#define TC_GATE_VOTES 2
+
+// tc_stats_add high time of a gate
+#define TC_HIGH_UNKNOWN U64_MAX
 
 
 
@@ -392,14 +596,15 @@ void tc_start(void *base,u32 channel)
 
 
 
-static int _tcd_capture_polling(void *base)
+static int _tcd_capture_polling(struct tc_channel *ch)
 {
+	void *base = ch->tc->base;
 	u32 i;
 
 	for (i = 0; i < MAX_BUFF_COUNT; i ++) {
-		while ((tc_get_status(base, CHANNEL_0) & TC_SR_LDRBS) != TC_SR_LDRBS);
-		tc_get_ra_rb_rc(base,CHANNEL_0, &buf_a[i], &buf_b[i]);
-		printk("a %u, b %u\n",buf_a[i],buf_b[i]);
+		while ((tc_get_status(base, ch->id) & TC_SR_LDRBS) != TC_SR_LDRBS);
+		tc_get_ra_rb_rc(base, ch->id, &ch->buf_a[i], &ch->buf_b[i]);
+		printk("a %u, b %u\n",ch->buf_a[i],ch->buf_b[i]);
 	}
 
 	
@@ -430,15 +635,23 @@ void tc_configure(void *base, u32 channel, u32 mode)
 
 
 
-void tc_init(void *base)
+void tc_init(void *base, u32 channel)
 {
 	u32 config;
 	// mck1 / 8
 	// TIOAx is used as an external trigger.
 	config = TC_CMR_TCCLKS_TIMER_CLOCK2 | TC_CMR_LDRA_RISING | TC_CMR_LDRB_FALLING | TC_CMR_ABETRG | TC_CMR_ETRGEDG_FALLING;
-	tc_configure(base, CHANNEL_0, config);
+	tc_configure(base, channel, config);
+
+	//tc_start(base,channel);
+}
+
+// the counter keeps running, only its clock changes
+static void tc_set_clock(struct tc_channel *ch, u32 sel)
+{
+	u32 cmr = readl(ch->regs + OFFSET_TC_CMR);
 
-	//tc_start(base,CHANNEL_0);
+	writel((cmr & ~TC_CMR_TCCLKS_Msk) | TC_CMR_TCCLKS(sel), ch->regs + OFFSET_TC_CMR);
 }
 
 void tc_disable_irq(void *base,u32 channel)
@@ -467,308 +680,2817 @@ void tc_enable_irq(void *base,u32 channel)
 }
 
 
-static irqreturn_t tc_interrupt(int irq, void *private)
-{
-	struct capture_data *ddata = private;
-	u32 stat;
-
+/*
+ * Everything here is a sum or a compare, the divisions are left to
+ * tc_stats_snapshot. The caller is inside a stats_seq write section.
+ */
+static void tc_stats_add(struct tc_stats *st, u64 high, u64 period, u32 flags)
+{
+	u64 d2, j;
+	s64 d;
+
+	if (!period)
+		return;
+
+	if (!st->count) {
+		st->ref = period;
+		st->min = period;
+		st->max = period;
+	} else {
+		j = period > st->prev ? period - st->prev : st->prev - period;
+		st->jitter[j ? min_t(u32, fls64(j), TC_CAPTURE_JITTER_BINS - 1) : 0]++;
+	}
+	st->prev = period;
+
+	st->count++;
+	if (flags & TC_SAMPLE_OVERRUN)
+		st->overruns++;
+	st->min = min(st->min, period);
+	st->max = max(st->max, period);
+	st->sum_period += period;
+	if (high != TC_HIGH_UNKNOWN) {
+		st->sum_high += high;
+		st->sum_duty += period;
+	}
 
-	stat = tc_get_status(ddata->base, CHANNEL_0);
-	if(stat & TC_SR_LDRBS){
-		
-		tc_get_ra_rb_rc(ddata->base, CHANNEL_0, &buf_a[ddata->buf_counter], &buf_b[ddata->buf_counter]);
-		
-		ddata->buf_counter++;
-		if(ddata->buf_counter >= MAX_BUFF_COUNT){
+	// d * d has to fit in a u64, deviations above 2 s all count the same
+	d = clamp_t(s64, (s64)(period - st->ref), -S32_MAX, S32_MAX);
+	d2 = (u64)(d * d);
+	st->sum_d += d;
+	st->sum_d2 = st->sum_d2 + d2 < st->sum_d2 ? U64_MAX : st->sum_d2 + d2;
+}
 
-			tc_stop(ddata->base, CHANNEL_0);
-			tc_disable_irq(ddata->base, CHANNEL_0);
-			ddata->capture_done = 1;
-			ddata->buf_counter = 0;
-			ddata->state = TC_IDLE;
+static u64 tc_ticks_ns(struct capture_data *ddata, u32 sel, u64 ticks)
+{
+	return mul_u64_u32_shr(ticks, ddata->clock_mult[sel], ddata->clock_shift[sel]);
+}
 
-			//debug_print("tc irq done, stat 0x%x\n",stat);
-			wake_up(&tc_wait);
-		}
-	}
-	
-	return IRQ_HANDLED;
-}
+// ra and rb in ticks of the channel's current clock, returns the period in ns
+static u64 tc_stats_sample(struct tc_channel *ch, u64 ra, u64 rb, u32 flags)
+{
+	struct capture_data *ddata = ch->tc;
+	u64 period = tc_ticks_ns(ddata, ch->clksel, rb);
 
+	tc_stats_add(&ch->stats, tc_ticks_ns(ddata, ch->clksel, rb - min(ra, rb)),
+		     period, flags);
 
+	return period;
+}
 
+/*
+ * One scan of the iio buffer, period and high time in ns, high 0 for a
+ * gate. The timestamp follows the iio device's clock, realtime or else
+ * monotonic.
+ */
+static void tc_iio_push(struct tc_channel *ch, u64 period, u64 high, u64 mono)
+{
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+	struct {
+		u64 period;
+		u64 high;
+		s64 ts __aligned(8);
+	} scan = {
+		.period = period,
+		.high = high == TC_HIGH_UNKNOWN ? 0 : high,
+	};
+	clockid_t clk = iio_device_get_clock(ch->iio);
+
+	if (clk == CLOCK_REALTIME || clk == CLOCK_REALTIME_COARSE)
+		mono += ch->real_offs;
+	iio_push_to_buffers_with_timestamp(ch->iio, &scan, mono);
+#endif
+}
 
+/*
+ * A submitted request sits on its channel's list until it has its periods
+ * or times out, both under stats_lock. It stays on the client's list until
+ * the client reads it or closes.
+ */
+struct tc_measure {
+	struct list_head node;		/* ch->measures, while pending */
+	struct list_head client_node;
+	struct tc_measure_client *client;
+	struct tc_channel *ch;
+	struct timer_list timer;
+	u64 user_data;
+	u32 want;
+	u32 got;
+	u32 highs;			/* periods with a high time */
+	u64 sum_period;
+	u64 sum_high;
+	u64 mono;
+	int status;
+	bool done;
+};
 
+struct tc_measure_client {
+	struct capture_data *tc;
+	struct mutex lock;		/* reqs */
+	struct list_head reqs;
+	u32 nr_reqs;
+	atomic_t ready;			/* done, not read yet */
+	wait_queue_head_t wait;
+	spinlock_t efd_lock;
+	struct eventfd_ctx *efd;
+};
 
+/*
+ * under stats_lock. A reader checks done under the same lock, so it frees
+ * m, and release the client, only after this has finished with both.
+ */
+static void tc_measure_complete(struct tc_measure *m, int status)
+{
+	struct tc_measure_client *c = m->client;
+	struct tc_channel *ch = m->ch;
+
+	list_del(&m->node);
+	m->status = status;
+	m->done = true;
+
+	atomic_inc(&c->ready);
+	wake_up_interruptible(&c->wait);
+	spin_lock(&c->efd_lock);
+	if (c->efd)
+		eventfd_signal(c->efd, 1);
+	spin_unlock(&c->efd_lock);
+
+	// the last one gives back a stream it started
+	if (list_empty(&ch->measures))
+		schedule_work(&ch->measure_work);
+}
 
-#if 0
-static struct hrtimer timer;
+// every request on the channel counts the period
+static void tc_measure_result(struct tc_channel *ch, u64 period, u64 high, u64 mono)
+{
+	struct tc_measure *m, *n;
 
+	list_for_each_entry_safe(m, n, &ch->measures, node) {
+		m->sum_period += period;
+		if (high != TC_HIGH_UNKNOWN) {
+			m->sum_high += high;
+			m->highs++;
+		}
+		m->mono = mono;
+		if (++m->got == m->want) {
+			del_timer(&m->timer);
+			tc_measure_complete(m, 0);
+		}
+	}
+}
 
-ktime_t star;
-ktime_t end;
-ktime_t kt;
+// inside a stats write section
+static void tc_publish(struct tc_channel *ch, u64 period, u64 high, u64 mono)
+{
+	if (READ_ONCE(ch->iio_on) && period)
+		tc_iio_push(ch, period, high, mono);
+	if (period && !list_empty(&ch->measures))
+		tc_measure_result(ch, period, high, mono);
+
+	ch->result.period = period;
+	ch->result.high = high;
+	ch->result.mono = mono;
+	ch->result.seq++;
+}
 
-static enum hrtimer_restart hrtimer_handler(struct hrtimer *timer)
+// never blocks, a reader that races a writer just reads again
+static void tc_result_read(struct tc_channel *ch, struct tc_result *r)
 {
-	
-	end = timer->base->get_time();
-	//hrtimer_forward(timer, now, kt);
-	printk("\nhr end\n");
-	printk("start time : %lld ns\n",star);
-	printk("end time   : %lld ns\n",end);
-	
-	//return HRTIMER_RESTART;
-	return HRTIMER_NORESTART;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&ch->stats_seq);
+		*r = ch->result;
+	} while (read_seqcount_retry(&ch->stats_seq, seq));
 }
 
-void hr_timer_test(void)
+static void tc_stats_begin(struct tc_channel *ch, unsigned long *flags)
 {
-	
-	
-	kt = ktime_set(0, 1000*1000*1000); /* 1 sec */
-	hrtimer_init(&timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	timer.function = hrtimer_handler;
-	
-	hrtimer_start(&timer, kt, HRTIMER_MODE_REL);
-	printk("hr start\n");
+	spin_lock_irqsave(&ch->stats_lock, *flags);
+	write_seqcount_begin(&ch->stats_seq);
+}
 
-	star = timer.base->get_time();
-	//printk("start time : %lld ns\n",now.tv64);
-		 
+static void tc_stats_end(struct tc_channel *ch, unsigned long flags)
+{
+	write_seqcount_end(&ch->stats_seq);
+	spin_unlock_irqrestore(&ch->stats_lock, flags);
 }
 
-#endif
+static void tc_stats_reset(struct tc_channel *ch)
+{
+	unsigned long flags;
 
-static ssize_t sys_read_frequency(struct device *dev, struct device_attribute *attr,char *buf)
+	tc_stats_begin(ch, &flags);
+	memset(&ch->stats, 0, sizeof(ch->stats));
+	tc_stats_end(ch, flags);
+}
+
+// a / n with frac fractional bits, n is a sample count so r << frac fits
+static u64 tc_div_frac(u64 a, u64 n, int frac)
 {
-	struct platform_device *pdev;
-	struct capture_data *ddata;
+	u64 q = div64_u64(a, n);
 
-	pdev = container_of(dev, struct platform_device, dev);
-	ddata = platform_get_drvdata(pdev);
-	
-	return scnprintf(buf, PAGE_SIZE, "%d\n",ddata->frequency);
+	return (q << frac) + div64_u64((a - q * n) << frac, n);
+}
 
- } 
- 
+static void tc_stats_snapshot(struct tc_channel *ch, struct tc_capture_stats *out)
+{
+	struct tc_stats st;
+	u64 ad, m2, var, p, h;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&ch->stats_seq);
+		st = ch->stats;
+	} while (read_seqcount_retry(&ch->stats_seq, seq));
+
+	memset(out, 0, sizeof(*out));
+	out->reranges = st.reranges;
+	if (!st.count)
+		return;
+
+	out->count = st.count;
+	out->overruns = st.overruns;
+	out->min_period = st.min;
+	out->max_period = st.max;
+	out->sum_period = st.sum_period;
+	out->sum_high = st.sum_high;
+	memcpy(out->jitter, st.jitter, sizeof(out->jitter));
+
+	out->mean_period = tc_div_frac(st.sum_period, st.count, TC_CAPTURE_STATS_FRAC);
+
+	/*
+	 * n var = sum d^2 - (sum d)^2 / n in ns^2, d is the deviation from the
+	 * first period, (sum d)^2 / n is at most sum d^2 so it fits. The
+	 * fractional bits go in before the root only while var << 2 frac fits.
+	 */
+	ad = st.sum_d < 0 ? -st.sum_d : st.sum_d;
+	m2 = mul_u64_u64_div_u64(ad, ad, st.count);
+	m2 = st.sum_d2 > m2 ? st.sum_d2 - m2 : 0;
+	var = div64_u64(m2, st.count);
+	if (var >> (64 - 2 * TC_CAPTURE_STATS_FRAC))
+		out->stddev = (u64)int_sqrt64(var) << TC_CAPTURE_STATS_FRAC;
+	else
+		out->stddev = int_sqrt64(mul_u64_u64_div_u64(m2,
+					1ULL << (2 * TC_CAPTURE_STATS_FRAC), st.count));
+
+	for (p = st.sum_duty, h = st.sum_high; p >> 53; p >>= 1, h >>= 1)
+		;
+	if (p)
+		out->duty = div64_u64(h * 1000, p);
+}
 
-static ssize_t sys_read_duty(struct device *dev, struct device_attribute *attr,char *buf)
+static u32 tc_dma_position(struct tc_channel *ch)
 {
-	struct platform_device *pdev;
-	struct capture_data *ddata;
+	struct dma_tx_state state;
+	u32 pos;
 
-	pdev = container_of(dev, struct platform_device, dev);
-	ddata = platform_get_drvdata(pdev);
+	dmaengine_tx_status(ch->dma_chan, ch->dma_cookie, &state);
+	pos = (ch->dma_words * 4 - state.residue) / 4;
 
+	return (pos % ch->dma_words) & ~1u;
+}
 
-	return scnprintf(buf, PAGE_SIZE, "%d\n", ddata->duty);
- 
- } 
- 
+/*
+ * Change the clock of a running stream. The counter keeps counting, so the
+ * period around the change mixes two clocks, and so may the pair the TC
+ * already holds: the next two samples are pushed as TC_SAMPLE_RERANGE. With
+ * dma the samples before the position the dma has reached still have the
+ * old clock, the callback switches when it gets there.
+ */
+static void tc_range_switch(struct tc_channel *ch, u32 sel)
+{
+	tc_set_clock(ch, sel);
+	ch->stats.reranges++;
+	ch->range_count = 0;
+
+	if (ch->dma_chan) {
+		ch->range_pos = tc_dma_position(ch);
+		ch->range_next = sel;
+	} else {
+		ch->clksel = sel;
+		ch->settle = 2;
+	}
+}
 
+static bool tc_range_busy(struct tc_channel *ch)
+{
+	return ch->settle || ch->range_pos != TC_RANGE_NONE;
+}
 
-static ssize_t sys_write_trigger(struct device *dev, struct device_attribute *attr,const char *buf, size_t count) 
- { 
-	int i;
-	int ret;
-	struct platform_device *pdev;
-	struct capture_data *ddata;
-	u32 rb, ra;
+/*
+ * Auto ranging, rb is the extended period in ticks. The fastest clock is the
+ * most precise, the 32 bit counter still has to hold a period with some
+ * margin: a period past 2^31 ticks asks for the next slower clock, one that
+ * stays below 2^30 ticks of the next faster clock for that one. A vote acts
+ * after TC_RANGE_VOTES periods in a row, a period that overflowed at once.
+ */
+static void tc_range_check(struct tc_channel *ch, u64 rb)
+{
+	struct capture_data *ddata = ch->tc;
+	u32 sel = ch->clksel;
+	int vote = 0;
+
+	if (rb >= BIT_ULL(31)) {
+		if (sel < TC_NR_CLOCKS - 1)
+			vote = 1;
+	} else if (sel && rb * ddata->clock_hz[sel - 1] < BIT_ULL(30) * ddata->clock_hz[sel]) {
+		vote = -1;
+	}
 
+	if (vote != ch->range_vote) {
+		ch->range_vote = vote;
+		ch->range_count = 0;
+	}
+	if (!vote)
+		return;
+	if (++ch->range_count < TC_RANGE_VOTES && !(rb >> 32))
+		return;
 
-	pdev = container_of(dev, struct platform_device, dev);
-	ddata = platform_get_drvdata(pdev);
+	tc_range_switch(ch, sel + vote);
+}
 
-	if(*buf =='1' ){
-		tc_disable_irq(ddata->base, CHANNEL_0);
-		tc_start(ddata->base,CHANNEL_0);
-		
-		_tcd_capture_polling(ddata->base);
+/*
+ * Capture follows every edge, fine until the edges come faster than the irq
+ * or the dma callback can take them. After TC_RANGE_VOTES periods in a row
+ * above gate_hz the channel is stopped right here, so a fast input does not
+ * keep the cpu in the irq, and mode_work starts the gated counting.
+ */
+static void tc_mode_check(struct tc_channel *ch, u64 period)
+{
+	if (ch->gate_id < 0 || !gate_hz || ch->mode_pending)
+		return;
 
-		
-		printk("frequency is %u, pulse is %u\n",(u32)ddata->clk_rate / 8 / buf_b[4], (buf_b[4] - buf_a[4]) * 1000 / buf_b[4]);
-		tc_stop(ddata->base,CHANNEL_0);
+	if (period >= NSEC_PER_SEC / gate_hz) {
+		ch->mode_votes = 0;
+		return;
 	}
-	else if(*buf == '2'){
+	if (++ch->mode_votes < TC_RANGE_VOTES)
+		return;
 
-		if(ddata->state != TC_RUNNING){
-			tc_stop(ddata->base,CHANNEL_0);
-			tc_enable_irq(ddata->base,CHANNEL_0);
-			tc_start(ddata->base,CHANNEL_0);
+	if (!ch->dma_chan) {
+		tc_stop(ch->tc->base, ch->id);
+		tc_disable_irq(ch->tc->base, ch->id);
+	}
+	ch->mode_pending = true;
+	schedule_work(&ch->mode_work);
+}
 
-			ddata->capture_done = 0;
-			ddata->buf_counter = 0;
-			ddata->state = TC_RUNNING;
-			ddata->frequency = 0;
-			ddata->duty = 0;
-		}
+/*
+ * Date the last falling edge: the counter started there, so it was cv ticks
+ * before the system time read next to it. Called with the irqs off, the
+ * anchor goes to the next sample pushed. A clock change the dma has not
+ * reached yet is already running in the counter.
+ */
+static void tc_stamp_anchor(struct tc_channel *ch)
+{
+	ktime_t mono = ktime_get();
+	u32 cv = readl(ch->regs + OFFSET_TC_CV);
+	u32 sel = ch->range_pos != TC_RANGE_NONE ? ch->range_next : ch->clksel;
+
+	ch->anchor_ns = ktime_to_ns(mono) - tc_ticks_ns(ch->tc, sel, cv);
+	ch->real_offs = ktime_to_ns(ktime_mono_to_real(mono)) - ktime_to_ns(mono);
+	if (ch->pps && IS_ENABLED(CONFIG_NTP_PPS))
+		ch->raw_offs = ktime_to_ns(ktime_get_raw()) - ktime_to_ns(mono);
+}
 
-		ret = wait_event_interruptible_timeout(tc_wait,
-			ddata->capture_done == 1, HZ*5 );
-		
-		
-		// ddata->state = TC_IDLE;
-		if(!ret)
-			printk("time out\n");
-		else{
-		
-			rb = 0;
-			ra = 0;
-			
-			// the firt caputre value is unstable,ignore it
-			for (i = 1; i < MAX_BUFF_COUNT; i ++) {
-				debug_print("a %u, b %u\n",buf_a[i],buf_b[i]);
-				rb += buf_b[i];
-				ra += buf_a[i];	
-			}	
-			
-			rb = rb / (MAX_BUFF_COUNT -1);
-			ra = ra / (MAX_BUFF_COUNT -1);
-			
-			ddata->duty = (rb - ra) * 1000 / rb;
-			ddata->frequency = ddata->clk_rate / 8 / rb;
-			
-			debug_print("capture done,frequency is %d, pulse is %d\n",ddata->frequency ,ddata->duty);
-		}
-		
-		
+// falling edge of a period, the anchor or the last edge plus the period
+static u64 tc_stamp(struct tc_channel *ch, u64 rb)
+{
+	if (ch->anchor_ns) {
+		ch->edge_ns = ch->anchor_ns;
+		ch->anchor_ns = 0;
+	} else {
+		ch->edge_ns += tc_ticks_ns(ch->tc, ch->clksel, rb);
 	}
-	else if(*buf == '3'){
-		
-		// hr_timer_test();
+
+	return ch->edge_ns;
+}
+
+// the rising edge is the assert event, a PPS pulse starts the second
+static void tc_pps_event(struct tc_channel *ch, u64 rise_ns)
+{
+#if IS_ENABLED(CONFIG_PPS)
+	struct pps_event_time ev;
+
+	ev.ts_real = ns_to_timespec64(rise_ns + ch->real_offs);
+#ifdef CONFIG_NTP_PPS
+	ev.ts_raw = ns_to_timespec64(rise_ns + ch->raw_offs);
+#endif
+	pps_event(ch->pps, &ev, PPS_CAPTUREASSERT, NULL);
+#endif
+}
+
+/*
+ * producer side of the stream ring, the irq, the dma callback or the gate
+ * timer, only one at a time, inside a stats write section. A full ring
+ * drops the new sample, what is in the ring stays until the reader
+ * consumes it.
+ */
+static void tc_ring_put(struct tc_channel *ch, u64 ra, u64 rb, u32 flags, u64 mono)
+{
+	struct tc_capture_ring *ring = ch->ring;
+	struct tc_capture_sample *s;
+	u32 head = ring->head;
+	u32 tail = smp_load_acquire(&ring->tail);
+
+	if (head - tail > ch->ring_mask) {
+		WRITE_ONCE(ring->dropped, ring->dropped + 1);
+		return;
 	}
 
-	
-    return count;
- } 
+	s = &ch->samples[head & ch->ring_mask];
+	s->ra = lower_32_bits(ra);
+	s->rb = lower_32_bits(rb);
+	s->flags = flags;
+	s->ra_hi = min_t(u64, upper_32_bits(ra), U16_MAX);
+	s->rb_hi = min_t(u64, upper_32_bits(rb), U16_MAX);
+	s->mono_ns = mono;
+	s->real_ns = mono + ch->real_offs;
+	smp_store_release(&ring->head, head + 1);
+
+	// a reader only sleeps on an empty ring
+	if (head == tail)
+		wake_up_interruptible(&ch->stream_wait);
+}
 
+// a captured period, ra and rb are extended by the overflow count
+static void tc_stream_push(struct tc_channel *ch, u64 ra, u64 rb, u32 flags)
+{
+	u64 period, edge;
 
+	edge = tc_stamp(ch, rb);
 
-static DEVICE_ATTR(trigger, S_IRUGO | S_IWUSR,NULL,sys_write_trigger);
-static DEVICE_ATTR(frequency, S_IRUGO | S_IRUSR,sys_read_frequency,NULL);
-static DEVICE_ATTR(duty, S_IRUGO | S_IRUSR,sys_read_duty,NULL);
- 
-static struct attribute *tc_capture_attrs[]={
-	&dev_attr_trigger.attr,
-	&dev_attr_frequency.attr,
-	&dev_attr_duty.attr,
-	NULL,
-};
+	// the period that ends here started at the software trigger
+	if (ch->discard) {
+		ch->discard--;
+		return;
+	}
 
+	flags |= ch->clksel << TC_SAMPLE_CLOCK_SHIFT;
+	if (ch->settle) {
+		ch->settle--;
+		flags |= TC_SAMPLE_RERANGE;
+	} else {
+		period = tc_stats_sample(ch, ra, rb, flags);
+		tc_publish(ch, period, tc_ticks_ns(ch->tc, ch->clksel, rb - min(ra, rb)), edge);
+		if (ch->pps)
+			tc_pps_event(ch, edge - tc_ticks_ns(ch->tc, ch->clksel, rb - min(ra, rb)));
+		if (ch->autorange && !tc_range_busy(ch))
+			tc_range_check(ch, rb);
+		tc_mode_check(ch, period);
+	}
 
+	tc_ring_put(ch, ra, rb, flags, edge);
+}
 
+// the falling edge that loads RB also restarts the counter
+static u64 tc_extend_rb(struct tc_channel *ch, u32 rb)
+{
+	u64 v = (u64)ch->ovf << 32 | rb;
 
-struct attribute_group tc_group={
-	.attrs = tc_capture_attrs,
-	.name = "tc_capture",
-};
+	ch->ovf = 0;
+	return v;
+}
 
-static int tc_capture_probe(struct platform_device *pdev)
+/*
+ * Move every capture the channel holds into the ring. TC_SR clears on read,
+ * so after each round the status is read again, until no load is pending or
+ * the budget is used up. TC_RAB returns RA and RB in the order they were
+ * loaded: with both pending that is RB then RA if an RA was already waiting
+ * for its RB, RA then RB otherwise. An RB without an RA (the first edge, or
+ * an overrun) is dropped, an RA keeps waiting across irqs. COVFS counts
+ * counter wraps since the last falling edge, they become the upper bits.
+ */
+static void tc_drain(struct tc_channel *ch, u32 stat)
 {
-	//struct device_node *np = pdev->dev.of_node;
-	struct resource *res;
-	struct capture_data *ddata;
-	int err,ret;
-	unsigned long clk_rate;
+	void __iomem *rab = ch->regs + OFFSET_TC_RAB;
+	int budget = TC_DRAIN_BUDGET;
+	unsigned long irqflags;
+	u32 flags = 0;
+	u32 ra, hi;
+	u64 rb;
+
+	// one stats write section for the whole batch
+	tc_stats_begin(ch, &irqflags);
+	do {
+		if (stat & TC_SR_LOVRS)
+			flags |= TC_SAMPLE_OVERRUN;
+		if (stat & TC_SR_COVFS)
+			ch->ovf++;
+
+		if (ch->have_ra && (stat & TC_SR_LDRBS)) {
+			tc_stream_push(ch, ch->ra_pending, tc_extend_rb(ch, readl(rab)), flags);
+			ch->have_ra = false;
+			flags = 0;
+			stat &= ~TC_SR_LDRBS;
+		}
 
-	debug_print("\ntc_capture_probe\n");
+		if (stat & TC_SR_LDRAS) {
+			ra = readl(rab);
+			// a wrap seen together with an RA close to it came after the RA
+			hi = ch->ovf;
+			if ((stat & TC_SR_COVFS) && (ra & BIT(31)) && hi)
+				hi--;
+			ch->ra_pending = (u64)hi << 32 | ra;
+			ch->have_ra = true;
+		}
 
-	
-	ddata = devm_kzalloc(&pdev->dev, sizeof(*ddata), GFP_KERNEL);
-	if (!ddata)
-		return -ENOMEM;
+		if (stat & TC_SR_LDRBS) {
+			rb = tc_extend_rb(ch, readl(rab));
+			if (ch->have_ra) {
+				tc_stream_push(ch, ch->ra_pending, rb, flags);
+				ch->have_ra = false;
+				flags = 0;
+			}
+		}
 
-	platform_set_drvdata(pdev, ddata);
-	
+		// the anchor is the edge of the first RB only, see tc_channel_irq
+		ch->anchor_ns = 0;
 
-	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	ddata->base = devm_ioremap_resource(&pdev->dev, res);
-	if (IS_ERR(ddata->base))
-		return PTR_ERR(ddata->base);
+		// a load after the last status read raises the irq again
+		if (!--budget)
+			break;
+		stat = readl(ch->regs + OFFSET_TC_SR);
+	} while (stat & (TC_SR_COVFS | TC_SR_LDRAS | TC_SR_LDRBS));
+	tc_stats_end(ch, irqflags);
+}
 
-	ddata->irq = platform_get_irq(pdev, 0);
-	if (ddata->irq < 0)
-		return -ENODEV;
+/*
+ * With dma only the overflow interrupt is on. The periods in the dma buffer
+ * cannot be extended, a counter wrap moves the stream to a slower clock.
+ */
+static void tc_dma_overflow(struct tc_channel *ch, u32 stat)
+{
+	unsigned long flags;
 
-	
+	if (!(stat & TC_SR_COVFS) || !ch->autorange)
+		return;
 
-	ddata->clk = devm_clk_get(&pdev->dev, NULL);
-	if (IS_ERR(ddata->clk))
-		return PTR_ERR(ddata->clk);
+	tc_stats_begin(ch, &flags);
+	if (!tc_range_busy(ch) && ch->clksel < TC_NR_CLOCKS - 1)
+		tc_range_switch(ch, ch->clksel + 1);
+	tc_stats_end(ch, flags);
+}
+
+/*
+ * A burst is MAX_BUFF_COUNT captures, the first is unstable and left out,
+ * the result is the mean of the others. Inside a stats write section.
+ */
+static void tc_burst_publish(struct tc_channel *ch)
+{
+	u64 ra = 0, rb = 0;
+	int i;
 
+	for (i = 1; i < MAX_BUFF_COUNT; i++) {
+		ra += ch->buf_a[i];
+		rb += ch->buf_b[i];
+	}
 
+	tc_publish(ch, div_u64(tc_ticks_ns(ch->tc, ch->clksel, rb), MAX_BUFF_COUNT - 1),
+		   div_u64(tc_ticks_ns(ch->tc, ch->clksel, rb - min(ra, rb)), MAX_BUFF_COUNT - 1),
+		   ktime_get_ns());
+}
 
-	ddata->clk_rate = clk_rate = clk_get_rate(ddata->clk);
-	debug_print("get clk rate %ld\n",clk_rate);
+static irqreturn_t tc_channel_irq(struct tc_channel *ch)
+{
+	struct capture_data *ddata = ch->tc;
+	unsigned long flags;
+	u32 stat;
+
+	/*
+	 * TC_SR clears on read, a channel that is polled from sysfs or
+	 * streamed by dma has no interrupt enabled and must not be touched
+	 */
+	if (!readl(ch->regs + OFFSET_TC_IMR))
+		return IRQ_NONE;
+
+	/*
+	 * the counter restarted at the newest falling edge, whose RB is the
+	 * first one tc_drain reads, date it before the status is read
+	 */
+	if (ch->state == TC_STREAMING && !ch->dma_chan && !ch->gated)
+		tc_stamp_anchor(ch);
+
+	stat = readl(ch->regs + OFFSET_TC_SR);
+	if (ch->state == TC_STREAMING && ch->dma_chan)
+		tc_dma_overflow(ch, stat);
+	else if (ch->state == TC_STREAMING)
+		tc_drain(ch, stat);
+	else if(stat & TC_SR_LDRBS){
+		// the periodic timer rearms the burst concurrently
+		tc_stats_begin(ch, &flags);
+		tc_get_ra_rb_rc(ddata->base, ch->id, &ch->buf_a[ch->buf_counter], &ch->buf_b[ch->buf_counter]);
+
+		// the first capture is unstable, see tc_burst_publish
+		if (ch->buf_counter)
+			tc_stats_sample(ch, ch->buf_a[ch->buf_counter], ch->buf_b[ch->buf_counter],
+					(stat & TC_SR_LOVRS) ? TC_SAMPLE_OVERRUN : 0);
+
+		ch->buf_counter++;
+		if(ch->buf_counter >= MAX_BUFF_COUNT){
+
+			tc_stop(ddata->base, ch->id);
+			tc_disable_irq(ddata->base, ch->id);
+			tc_burst_publish(ch);
+			ch->capture_done = 1;
+			ch->buf_counter = 0;
+			if (ch->state == TC_RUNNING)
+				ch->state = TC_IDLE;
+
+			//debug_print("tc irq done, stat 0x%x\n",stat);
+			wake_up(&ch->wait);
+		}
+		tc_stats_end(ch, flags);
+	}
 	
-	err = clk_prepare_enable(ddata->clk);
-	if (err)
-		return err;
+	return IRQ_HANDLED;
+}
 
+// one interrupt per channel
+static irqreturn_t tc_interrupt(int irq, void *private)
+{
+	return tc_channel_irq(private);
+}
 
-	tc_init(ddata->base);
+static void tc_qdec_put(struct tc_qdec *q, struct tc_qdec_event ev, u32 type)
+{
+	ev.type = type;
+	if (q->lost)
+		ev.flags |= TC_QDEC_LOST;
 
+	q->lost = !kfifo_put(&q->events, ev);
+}
 
+// TC_QISR clears on read, it only has the index and direction changes enabled
+static irqreturn_t tc_qdec_irq(struct tc_qdec *q)
+{
+	void __iomem *base = q->tc->base;
+	struct tc_qdec_event ev = { 0 };
+	u32 isr;
 
-	ret = request_irq(ddata->irq, tc_interrupt, 0,
-			  pdev->dev.driver->name, ddata);
-	if (ret) {
-		dev_err(&pdev->dev, "Failed to allocate IRQ.\n");
-		return ret;
-	}	
+	isr = readl(base + OFFSET_TC_QISR) & readl(base + OFFSET_TC_QIMR);
+	if (!(isr & (TC_QISR_IDX | TC_QISR_DIRCHG)))
+		return IRQ_NONE;
 
+	ev.mono_ns = ktime_get_ns();
+	ev.position = readl(base + OFFSET_TC_CV);
+	ev.revolutions = readl(base + 0x40 + OFFSET_TC_CV);
+	if (readl(base + OFFSET_TC_QSR) & TC_QSR_DIR)
+		ev.flags = TC_QDEC_REVERSE;
 
-	if(sysfs_create_group(&pdev->dev.kobj, &tc_group) != 0)
-	{
-		printk("create %s sys-file err \n",tc_group.name);
-	}
-	//g_data = ddata;
+	if (isr & TC_QISR_IDX)
+		tc_qdec_put(q, ev, TC_QDEC_INDEX);
+	if (isr & TC_QISR_DIRCHG)
+		tc_qdec_put(q, ev, TC_QDEC_DIRECTION);
 
+	wake_up_interruptible(&q->wait);
 
-	return 0;
+	return IRQ_HANDLED;
+}
 
+static irqreturn_t tc_qdec_interrupt(int irq, void *private)
+{
+	return tc_qdec_irq(private);
 }
 
+// one interrupt for the whole TC block, find the channels that raised it
+static irqreturn_t tc_block_interrupt(int irq, void *private)
+{
+	struct capture_data *ddata = private;
+	struct tc_channel *ch;
+	irqreturn_t ret = IRQ_NONE;
 
+	if (ddata->qdec && tc_qdec_irq(ddata->qdec) == IRQ_HANDLED)
+		ret = IRQ_HANDLED;
 
-static int tc_capture_remove(struct platform_device *pdev)
-{
-	struct capture_data *ddata = platform_get_drvdata(pdev);
-	int ret = 0;
+	for_each_tc_channel(ddata, ch) {
+		if (tc_channel_irq(ch) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+	}
 
-	tc_stop(ddata->base,CHANNEL_0);
-	tc_disable_irq(ddata->base,CHANNEL_0);
-	free_irq(ddata->irq,ddata);
-		
-	clk_disable_unprepare(ddata->clk);
-	sysfs_remove_group(&pdev->dev.kobj, &tc_group);
-	
 	return ret;
 }
 
-static const struct of_device_id tc_capture_of_match[] = {
-	{ .compatible = "microchip,tc-capture" },
-	{ .compatible = "sama7g54,tc-capture" },
-	{ /* sentinel */ }
-};
-MODULE_DEVICE_TABLE(of, tc_capture_of_match);
+static int tc_channel_irqno(struct tc_channel *ch)
+{
+	struct capture_data *ddata = ch->tc;
 
+	return ddata->nr_irqs > 1 ? ddata->irq[ch->id] : ddata->irq[0];
+}
 
 
-static struct platform_driver tc_capture_driver = {
-	.probe	= tc_capture_probe,
-	.remove		= tc_capture_remove,
-	.driver	= {
-		.name		= "microchip_tc_capure",
-		.of_match_table	= tc_capture_of_match,
-	},
-};
 
-module_platform_driver(tc_capture_driver);
 
-MODULE_AUTHOR("murphy.xu");
-MODULE_DESCRIPTION("microchip tc capture driver");
-MODULE_LICENSE("GPL v2");
 
 
+
+/*
+ * The dma reads TC_RAB, which returns RA and RB in the order they were
+ * loaded, so the cyclic buffer holds RA,RB pairs. The callback runs once per
+ * period and moves everything up to the current dma position into the ring,
+ * only whole pairs, the second half of a pair is picked up next time.
+ */
+static void tc_dma_callback(void *param)
+{
+	struct tc_channel *ch = param;
+	unsigned long flags;
+	u64 back = 0;
+	u32 pos, sel, i;
+	int tries = TC_DMA_ANCHOR_TRIES;
+
+	tc_stats_begin(ch, &flags);
+	/*
+	 * the anchor dates the newest falling edge, which has to be the last
+	 * pair the dma moved: read the position after the counter, again if a
+	 * pair landed in between
+	 */
+	do {
+		pos = tc_dma_position(ch);
+		tc_stamp_anchor(ch);
+	} while (tc_dma_position(ch) != pos && --tries);
+
+	// count the batch back from it so tc_stamp lands there, each pair
+	// with the clock it was captured at
+	sel = ch->clksel;
+	for (i = ch->dma_pos; i != pos; i = (i + 2) % ch->dma_words) {
+		if (i == ch->range_pos)
+			sel = ch->range_next;
+		back += tc_ticks_ns(ch->tc, sel, ch->dma_buf[i + 1]);
+	}
+	if (back)
+		ch->edge_ns = ch->anchor_ns - back;
+	ch->anchor_ns = 0;
+
+	for (i = ch->dma_pos; i != pos; i = (i + 2) % ch->dma_words) {
+		// see tc_range_switch
+		if (i == ch->range_pos) {
+			ch->clksel = ch->range_next;
+			ch->settle = 2;
+			ch->range_pos = TC_RANGE_NONE;
+		}
+		tc_stream_push(ch, ch->dma_buf[i], ch->dma_buf[i + 1], 0);
+	}
+	tc_stats_end(ch, flags);
+
+	ch->dma_pos = pos;
+}
+
+static int tc_dma_start(struct tc_channel *ch)
+{
+	struct dma_async_tx_descriptor *desc;
+	dma_cookie_t cookie;
+	size_t len = ch->dma_words * 4;
+
+	desc = dmaengine_prep_dma_cyclic(ch->dma_chan, ch->dma_addr, len,
+					 len / TC_DMA_PERIODS, DMA_DEV_TO_MEM,
+					 DMA_PREP_INTERRUPT);
+	if (!desc)
+		return -EBUSY;
+
+	desc->callback = tc_dma_callback;
+	desc->callback_param = ch;
+	cookie = dmaengine_submit(desc);
+	if (dma_submit_error(cookie))
+		return -EIO;
+
+	ch->dma_cookie = cookie;
+	ch->dma_pos = 0;
+	dma_async_issue_pending(ch->dma_chan);
+
+	return 0;
+}
+
+/*
+ * the channel's dma is "rx<channel>" in dma-names, channel 0 also takes the
+ * plain "rx" of single channel device trees
+ */
+static int tc_dma_init(struct device *dev, struct tc_channel *ch)
+{
+	struct dma_slave_config cfg = {
+		.direction	= DMA_DEV_TO_MEM,
+		.src_addr	= ch->tc->phys_base + 0x40 * ch->id + OFFSET_TC_RAB,
+		.src_addr_width	= DMA_SLAVE_BUSWIDTH_4_BYTES,
+		.src_maxburst	= 1,
+	};
+	struct dma_chan *chan;
+	char name[8];
+	int ret;
+
+	if (!use_dma)
+		return 0;
+
+	snprintf(name, sizeof(name), "rx%u", ch->id);
+	chan = dma_request_chan(dev, name);
+	if (IS_ERR(chan) && PTR_ERR(chan) != -EPROBE_DEFER && ch->id == 0)
+		chan = dma_request_chan(dev, "rx");
+	if (IS_ERR(chan)) {
+		if (PTR_ERR(chan) == -EPROBE_DEFER)
+			return -EPROBE_DEFER;
+		// no dma in the device tree, the irq reads the captures
+		return 0;
+	}
+
+	ret = dmaengine_slave_config(chan, &cfg);
+	if (ret)
+		goto err;
+
+	ch->dma_words = max(dma_period, 1u) * 2 * TC_DMA_PERIODS;
+	ch->dma_buf = dma_alloc_coherent(dev, ch->dma_words * 4,
+					 &ch->dma_addr, GFP_KERNEL);
+	if (!ch->dma_buf) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ch->dma_chan = chan;
+	dev_info(dev, "channel %u captures through %s, %u samples per period\n",
+		 ch->id, dma_chan_name(chan), max(dma_period, 1u));
+
+	return 0;
+err:
+	dma_release_channel(chan);
+	return ret;
+}
+
+static void tc_dma_free(struct device *dev, struct tc_channel *ch)
+{
+	if (!ch->dma_chan)
+		return;
+
+	dma_free_coherent(dev, ch->dma_words * 4, ch->dma_buf, ch->dma_addr);
+	dma_release_channel(ch->dma_chan);
+	ch->dma_chan = NULL;
+}
+
+// capture: RA and RB of every period, read by the irq or by the dma
+static int tc_capture_start(struct tc_channel *ch)
+{
+	void *base = ch->tc->base;
+	int ret;
+
+	ch->discard = 1;
+	ch->have_ra = false;
+	ch->ovf = 0;
+	ch->settle = 0;
+	ch->range_vote = 0;
+	ch->range_count = 0;
+	ch->range_pos = TC_RANGE_NONE;
+
+	tc_stop(base, ch->id);
+	if (ch->dma_chan) {
+		// one dma request per capture, no per edge interrupt
+		tc_disable_irq(base, ch->id);
+		ret = tc_dma_start(ch);
+		if (ret)
+			return ret;
+	} else {
+		tc_enable_irq(base, ch->id);
+	}
+	// counter wraps, for the upper bits or to pick a slower clock
+	writel(TC_IER_COVFS, ch->regs + OFFSET_TC_IER);
+	tc_start(base, ch->id);
+
+	return 0;
+}
+
+static void tc_capture_stop(struct tc_channel *ch)
+{
+	void *base = ch->tc->base;
+
+	tc_stop(base, ch->id);
+	tc_disable_irq(base, ch->id);
+	synchronize_irq(tc_channel_irqno(ch));
+	if (ch->dma_chan)
+		dmaengine_terminate_sync(ch->dma_chan);
+}
+
+// one gate, edges rising edges of the input in ns, ending at mono
+static void tc_gate_push(struct tc_channel *ch, u64 edges, u64 ns, u64 mono)
+{
+	if (edges) {
+		tc_stats_add(&ch->stats, TC_HIGH_UNKNOWN, div64_u64(ns, edges),
+			     TC_SAMPLE_GATED);
+		tc_publish(ch, div64_u64(ns, edges), TC_HIGH_UNKNOWN, mono);
+	}
+	tc_ring_put(ch, edges, ns, TC_SAMPLE_GATED, mono);
+
+	// capture again once the input is well below gate_hz
+	if (ch->mode_pending)
+		return;
+	if (gate_hz && edges * NSEC_PER_SEC >= (u64)gate_hz / 2 * ns) {
+		ch->mode_votes = 0;
+		return;
+	}
+	if (++ch->mode_votes < TC_GATE_VOTES)
+		return;
+
+	ch->mode_pending = true;
+	schedule_work(&ch->mode_work);
+}
+
+/*
+ * The counting channel runs from our TIOA through its XC. The gate is the
+ * time between two timer runs, taken with ktime_get next to the CV read,
+ * so the timer latency does not count, only the few cycles between the
+ * two reads.
+ */
+static enum hrtimer_restart tc_gate_timer(struct hrtimer *timer)
+{
+	struct tc_channel *ch = container_of(timer, struct tc_channel, gate_timer);
+	void __iomem *regs = ch->tc->base + 0x40 * ch->gate_id;
+	unsigned long flags;
+	ktime_t now;
+	u32 cv;
+
+	tc_stats_begin(ch, &flags);
+	now = ktime_get();
+	cv = readl(regs + OFFSET_TC_CV);
+	ch->real_offs = ktime_to_ns(ktime_mono_to_real(now)) - ktime_to_ns(now);
+	if (!ch->gate_first)
+		tc_gate_push(ch, cv - ch->gate_cv, ktime_to_ns(ktime_sub(now, ch->gate_time)),
+			     ktime_to_ns(now));
+	ch->gate_first = false;
+	ch->gate_cv = cv;
+	ch->gate_time = now;
+	tc_stats_end(ch, flags);
+
+	hrtimer_forward_now(timer, ms_to_ktime(max(gate_ms, 1u)));
+	return HRTIMER_RESTART;
+}
+
+static void tc_gate_start(struct tc_channel *ch)
+{
+	void __iomem *regs = ch->tc->base + 0x40 * ch->gate_id;
+
+	readl(regs + OFFSET_TC_SR);
+	writel(TC_CCR_CLKEN | TC_CCR_SWTRG, regs + OFFSET_TC_CCR);
+	ch->gate_first = true;
+	ch->gated = true;
+	hrtimer_start(&ch->gate_timer, 0, HRTIMER_MODE_REL);
+}
+
+static void tc_gate_stop(struct tc_channel *ch)
+{
+	hrtimer_cancel(&ch->gate_timer);
+	writel(TC_CCR_CLKDIS, ch->tc->base + 0x40 * ch->gate_id + OFFSET_TC_CCR);
+	ch->gated = false;
+}
+
+// see tc_mode_check and tc_gate_push
+static void tc_mode_work(struct work_struct *work)
+{
+	struct tc_channel *ch = container_of(work, struct tc_channel, mode_work);
+
+	mutex_lock(&ch->lock);
+	if (ch->state != TC_STREAMING)
+		goto out;
+
+	if (ch->gated) {
+		tc_gate_stop(ch);
+		if (tc_capture_start(ch))
+			dev_err(ch->tc->dev, "%s: capture restart failed\n", ch->name);
+	} else {
+		tc_capture_stop(ch);
+		tc_gate_start(ch);
+	}
+	ch->mode_votes = 0;
+	ch->mode_pending = false;
+out:
+	mutex_unlock(&ch->lock);
+}
+
+static struct tc_channel *tc_file_channel(struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+
+	return container_of(misc, struct tc_channel, miscdev);
+}
+
+// called with ch->lock held
+static int tc_stream_start(struct tc_channel *ch)
+{
+	int ret;
+
+	ch->ring->head = 0;
+	ch->ring->tail = 0;
+	ch->ring->dropped = 0;
+	ch->gated = false;
+	ch->mode_pending = false;
+	ch->mode_votes = 0;
+	ch->edge_ns = 0;
+	ch->anchor_ns = 0;
+	ch->state = TC_STREAMING;
+	tc_stats_reset(ch);
+
+	// every stream starts with capture, a fast input moves it to gated
+	ret = tc_capture_start(ch);
+	if (ret)
+		ch->state = TC_IDLE;
+
+	return ret;
+}
+
+// called with ch->lock held, drops it around the wait for mode_work
+static void tc_stream_stop(struct tc_channel *ch)
+{
+	if (ch->gated)
+		tc_gate_stop(ch);
+	else
+		tc_capture_stop(ch);
+	ch->state = TC_IDLE;
+
+	// nothing queues it any more, a queued one sees TC_IDLE
+	mutex_unlock(&ch->lock);
+	cancel_work_sync(&ch->mode_work);
+	mutex_lock(&ch->lock);
+}
+
+/*
+ * A channel in microchip,pps-channels is a PPS source for chrony and the
+ * like. It streams from probe to remove, the stream device only attaches a
+ * reader to it. It never takes a dma, each edge is read by the irq.
+ */
+static void tc_pps_init(struct tc_channel *ch)
+{
+#if IS_ENABLED(CONFIG_PPS)
+	struct pps_source_info info = {
+		.mode	= PPS_CAPTUREASSERT | PPS_OFFSETASSERT | PPS_CANWAIT |
+			  PPS_TSFMT_TSPEC,
+		.owner	= THIS_MODULE,
+		.dev	= ch->tc->dev,
+	};
+	struct pps_device *pps;
+
+	strscpy(info.name, ch->name, PPS_MAX_NAME_LEN);
+	pps = pps_register_source(&info, PPS_CAPTUREASSERT | PPS_OFFSETASSERT);
+	if (IS_ERR_OR_NULL(pps)) {
+		dev_err(ch->tc->dev, "%s: failed to register the pps source\n", ch->name);
+		return;
+	}
+
+	mutex_lock(&ch->lock);
+	ch->pps = pps;
+	if (tc_stream_start(ch)) {
+		ch->pps = NULL;
+		mutex_unlock(&ch->lock);
+		pps_unregister_source(pps);
+		dev_err(ch->tc->dev, "%s: failed to start the pps capture\n", ch->name);
+		return;
+	}
+	mutex_unlock(&ch->lock);
+#else
+	dev_warn(ch->tc->dev, "%s: no PPS support in this kernel\n", ch->name);
+#endif
+}
+
+static void tc_pps_free(struct tc_channel *ch)
+{
+	if (!ch->pps)
+		return;
+
+	mutex_lock(&ch->lock);
+	tc_stream_stop(ch);
+	mutex_unlock(&ch->lock);
+#if IS_ENABLED(CONFIG_PPS)
+	pps_unregister_source(ch->pps);
+#endif
+	ch->pps = NULL;
+}
+
+/*
+ * The stream has one consumer, the stream device or the iio buffer. It
+ * starts with the consumer, unless a pps keeps it running anyway.
+ */
+static int tc_stream_attach(struct tc_channel *ch)
+{
+	int ret = 0;
+
+	// one reader, the ring is single consumer
+	if (atomic_cmpxchg(&ch->stream_users, 0, 1))
+		return -EBUSY;
+
+	mutex_lock(&ch->lock);
+	if (ch->tc->gone) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (ch->pps) {
+		// the pps keeps the stream running, start at the newest sample
+		smp_store_release(&ch->ring->tail, smp_load_acquire(&ch->ring->head));
+		goto out;
+	}
+	if (ch->state != TC_IDLE) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = tc_stream_start(ch);
+out:
+	mutex_unlock(&ch->lock);
+	if (ret)
+		atomic_set(&ch->stream_users, 0);
+
+	return ret;
+}
+
+static void tc_stream_detach(struct tc_channel *ch)
+{
+	mutex_lock(&ch->lock);
+	// after remove the stream is stopped and the registers are gone
+	if (!ch->pps && ch->state == TC_STREAMING)
+		tc_stream_stop(ch);
+	mutex_unlock(&ch->lock);
+
+	atomic_set(&ch->stream_users, 0);
+}
+
+static void tc_capture_free(struct kref *ref)
+{
+	struct capture_data *ddata = container_of(ref, struct capture_data, ref);
+	struct tc_channel *ch;
+
+	for_each_tc_channel(ddata, ch)
+		vfree(ch->ring);
+	kfree(ddata);
+}
+
+static void tc_capture_put(struct capture_data *ddata)
+{
+	kref_put(&ddata->ref, tc_capture_free);
+}
+
+static void tc_capture_release(void *data)
+{
+	tc_capture_put(data);
+}
+
+static int tc_stream_open(struct inode *inode, struct file *file)
+{
+	struct tc_channel *ch = tc_file_channel(file);
+	int ret;
+
+	ret = tc_stream_attach(ch);
+	if (!ret)
+		kref_get(&ch->tc->ref);
+
+	return ret;
+}
+
+static int tc_stream_release(struct inode *inode, struct file *file)
+{
+	struct tc_channel *ch = tc_file_channel(file);
+
+	tc_stream_detach(ch);
+	tc_capture_put(ch->tc);
+
+	return 0;
+}
+
+#define TC_MEASURE_MAX 256		/* pending and unread requests per client */
+#define TC_MEASURE_TIMEOUT_MS 5000
+
+static void tc_measure_timeout(struct timer_list *t)
+{
+	struct tc_measure *m = from_timer(m, t, timer);
+	struct tc_channel *ch = m->ch;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ch->stats_lock, flags);
+	if (!m->done)
+		tc_measure_complete(m, -ETIMEDOUT);
+	spin_unlock_irqrestore(&ch->stats_lock, flags);
+}
+
+// stops the stream tc_measure_submit started once no request is left
+static void tc_measure_work(struct work_struct *work)
+{
+	struct tc_channel *ch = container_of(work, struct tc_channel, measure_work);
+	bool idle;
+
+	mutex_lock(&ch->measure_lock);
+	spin_lock_irq(&ch->stats_lock);
+	idle = list_empty(&ch->measures);
+	spin_unlock_irq(&ch->stats_lock);
+	if (idle && ch->measure_stream) {
+		ch->measure_stream = false;
+		tc_stream_detach(ch);
+	}
+	mutex_unlock(&ch->measure_lock);
+}
+
+/*
+ * called with c->lock held. An idle channel is started as a stream, a busy
+ * one (-EBUSY from the attach) already publishes results, the request just
+ * joins it.
+ */
+static int tc_measure_submit(struct tc_measure_client *c, const struct tc_measure_req *req)
+{
+	struct capture_data *ddata = c->tc;
+	struct tc_channel *ch;
+	struct tc_measure *m;
+	unsigned long flags;
+	int ret = 0;
+
+	if (req->channel >= TC_MAX_CHANNELS || !(ddata->channels & BIT(req->channel)) ||
+	    !req->periods)
+		return -EINVAL;
+	if (c->nr_reqs >= TC_MEASURE_MAX)
+		return -EBUSY;
+
+	ch = &ddata->ch[req->channel];
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	m->client = c;
+	m->ch = ch;
+	m->user_data = req->user_data;
+	m->want = req->periods;
+	timer_setup(&m->timer, tc_measure_timeout, 0);
+
+	mutex_lock(&ch->measure_lock);
+	if (!ch->measure_stream) {
+		ret = tc_stream_attach(ch);
+		if (!ret)
+			ch->measure_stream = true;
+		else if (ret != -EBUSY)
+			goto out;
+		ret = 0;
+	}
+
+	spin_lock_irqsave(&ch->stats_lock, flags);
+	list_add_tail(&m->node, &ch->measures);
+	mod_timer(&m->timer, jiffies +
+		  msecs_to_jiffies(req->timeout_ms ? req->timeout_ms : TC_MEASURE_TIMEOUT_MS));
+	spin_unlock_irqrestore(&ch->stats_lock, flags);
+
+	list_add_tail(&m->client_node, &c->reqs);
+	c->nr_reqs++;
+out:
+	mutex_unlock(&ch->measure_lock);
+	if (ret)
+		kfree(m);
+
+	return ret;
+}
+
+static int tc_measure_open(struct inode *inode, struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+	struct tc_measure_client *c;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	c->tc = container_of(misc, struct capture_data, measure_dev);
+	kref_get(&c->tc->ref);
+	mutex_init(&c->lock);
+	INIT_LIST_HEAD(&c->reqs);
+	atomic_set(&c->ready, 0);
+	init_waitqueue_head(&c->wait);
+	spin_lock_init(&c->efd_lock);
+	file->private_data = c;
+
+	return 0;
+}
+
+static int tc_measure_release(struct inode *inode, struct file *file)
+{
+	struct tc_measure_client *c = file->private_data;
+	unsigned long flush = 0;
+	struct tc_measure *m, *n;
+	struct tc_channel *ch;
+
+	list_for_each_entry_safe(m, n, &c->reqs, client_node) {
+		ch = m->ch;
+		spin_lock_irq(&ch->stats_lock);
+		if (!m->done) {
+			list_del(&m->node);
+			m->done = true;
+			if (list_empty(&ch->measures))
+				schedule_work(&ch->measure_work);
+		}
+		spin_unlock_irq(&ch->stats_lock);
+		del_timer_sync(&m->timer);
+		flush |= BIT(ch->id);
+		kfree(m);
+	}
+
+	// a stream the requests started is stopped before close returns
+	for_each_tc_channel(c->tc, ch) {
+		if (flush & BIT(ch->id))
+			flush_work(&ch->measure_work);
+	}
+
+	if (c->efd)
+		eventfd_ctx_put(c->efd);
+	tc_capture_put(c->tc);
+	kfree(c);
+
+	return 0;
+}
+
+// the requests before a bad one are queued, write returns their size
+static ssize_t tc_measure_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct tc_measure_client *c = file->private_data;
+	struct tc_measure_req req;
+	size_t done;
+	int ret = 0;
+
+	if (count < sizeof(req))
+		return -EINVAL;
+
+	mutex_lock(&c->lock);
+	for (done = 0; done + sizeof(req) <= count; done += sizeof(req)) {
+		if (copy_from_user(&req, buf + done, sizeof(req))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = tc_measure_submit(c, &req);
+		if (ret)
+			break;
+	}
+	mutex_unlock(&c->lock);
+
+	return done ? done : ret;
+}
+
+// moves the completed requests out, the bytes copied or 0 if none was done
+static ssize_t tc_measure_collect(struct tc_measure_client *c, char __user *buf, size_t count)
+{
+	struct tc_measure_done d;
+	struct tc_measure *m, *n;
+	ssize_t ret = 0;
+	bool done;
+
+	mutex_lock(&c->lock);
+	list_for_each_entry_safe(m, n, &c->reqs, client_node) {
+		if (ret + sizeof(d) > count)
+			break;
+		// the completion may still be signalling the client, wait it out
+		spin_lock_irq(&m->ch->stats_lock);
+		done = m->done;
+		spin_unlock_irq(&m->ch->stats_lock);
+		if (!done)
+			continue;
+
+		d.user_data = m->user_data;
+		d.status = m->status;
+		d.periods = m->got;
+		d.period_ns = m->got ? div_u64(m->sum_period, m->got) : 0;
+		d.high_ns = m->highs ? div_u64(m->sum_high, m->highs) : 0;
+		d.mono_ns = m->mono;
+		if (copy_to_user(buf + ret, &d, sizeof(d))) {
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
+
+		list_del(&m->client_node);
+		c->nr_reqs--;
+		atomic_dec(&c->ready);
+		del_timer_sync(&m->timer);
+		kfree(m);
+		ret += sizeof(d);
+	}
+	mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+static ssize_t tc_measure_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct tc_measure_client *c = file->private_data;
+	ssize_t ret;
+
+	if (count < sizeof(struct tc_measure_done))
+		return -EINVAL;
+
+	for (;;) {
+		ret = tc_measure_collect(c, buf, count);
+		if (ret)
+			return ret;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(c->wait, atomic_read(&c->ready) > 0);
+		if (ret)
+			return ret;
+	}
+}
+
+static __poll_t tc_measure_poll(struct file *file, poll_table *wait)
+{
+	struct tc_measure_client *c = file->private_data;
+
+	poll_wait(file, &c->wait, wait);
+
+	if (atomic_read(&c->ready) > 0)
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static long tc_measure_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct tc_measure_client *c = file->private_data;
+	struct eventfd_ctx *efd = NULL, *old;
+	s32 fd;
+
+	if (cmd != TC_CAPTURE_IOC_EVENTFD)
+		return -ENOTTY;
+
+	if (get_user(fd, (s32 __user *)arg))
+		return -EFAULT;
+	if (fd >= 0) {
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	spin_lock_irq(&c->efd_lock);
+	old = c->efd;
+	c->efd = efd;
+	spin_unlock_irq(&c->efd_lock);
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static const struct file_operations tc_measure_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tc_measure_open,
+	.release	= tc_measure_release,
+	.read		= tc_measure_read,
+	.write		= tc_measure_write,
+	.poll		= tc_measure_poll,
+	.unlocked_ioctl	= tc_measure_ioctl,
+	.llseek		= noop_llseek,
+};
+
+static ssize_t tc_stream_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct tc_channel *ch = tc_file_channel(file);
+	struct tc_capture_ring *ring = ch->ring;
+	size_t sz = sizeof(struct tc_capture_sample);
+	u32 head, tail, n, idx, first;
+	ssize_t ret;
+
+	if (count < sz)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&ch->read_lock))
+		return -ERESTARTSYS;
+
+	tail = ring->tail;
+	head = smp_load_acquire(&ring->head);
+	while (head == tail) {
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		ret = wait_event_interruptible(ch->stream_wait,
+				smp_load_acquire(&ring->head) != tail);
+		if (ret)
+			goto out;
+		head = smp_load_acquire(&ring->head);
+	}
+
+	n = min_t(u32, head - tail, count / sz);
+	idx = tail & ch->ring_mask;
+	first = min(n, ch->ring_mask + 1 - idx);
+
+	if (copy_to_user(buf, &ch->samples[idx], first * sz) ||
+	    copy_to_user(buf + first * sz, ch->samples, (n - first) * sz)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	smp_store_release(&ring->tail, tail + n);
+	ret = n * sz;
+out:
+	mutex_unlock(&ch->read_lock);
+	return ret;
+}
+
+static __poll_t tc_stream_poll(struct file *file, poll_table *wait)
+{
+	struct tc_channel *ch = tc_file_channel(file);
+	struct tc_capture_ring *ring = ch->ring;
+
+	poll_wait(file, &ch->stream_wait, wait);
+
+	if (smp_load_acquire(&ring->head) != READ_ONCE(ring->tail))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+// a mapping keeps the ring, it may outlive the file and the device
+static void tc_stream_vm_open(struct vm_area_struct *vma)
+{
+	struct capture_data *ddata = vma->vm_private_data;
+
+	kref_get(&ddata->ref);
+}
+
+static void tc_stream_vm_close(struct vm_area_struct *vma)
+{
+	tc_capture_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct tc_stream_vm_ops = {
+	.open	= tc_stream_vm_open,
+	.close	= tc_stream_vm_close,
+};
+
+static int tc_stream_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct tc_channel *ch = tc_file_channel(file);
+	int ret;
+
+	// head and tail belong to the driver
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_vmalloc_range(vma, ch->ring, vma->vm_pgoff);
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &tc_stream_vm_ops;
+	vma->vm_private_data = ch->tc;
+	tc_stream_vm_open(vma);
+
+	return 0;
+}
+
+static long tc_stream_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct tc_channel *ch = tc_file_channel(file);
+	struct tc_capture_ring *ring = ch->ring;
+	struct tc_capture_stats stats;
+	u32 n, tail;
+	long ret = 0;
+
+	switch (cmd) {
+	case TC_CAPTURE_IOC_CONSUME:
+		if (get_user(n, (u32 __user *)arg))
+			return -EFAULT;
+
+		mutex_lock(&ch->read_lock);
+		tail = ring->tail;
+		if (n > smp_load_acquire(&ring->head) - tail)
+			ret = -EINVAL;
+		else
+			smp_store_release(&ring->tail, tail + n);
+		mutex_unlock(&ch->read_lock);
+		return ret;
+
+	case TC_CAPTURE_IOC_STATS:
+		tc_stats_snapshot(ch, &stats);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations tc_stream_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tc_stream_open,
+	.release	= tc_stream_release,
+	.read		= tc_stream_read,
+	.poll		= tc_stream_poll,
+	.mmap		= tc_stream_mmap,
+	.unlocked_ioctl	= tc_stream_ioctl,
+	.llseek		= noop_llseek,
+};
+
+static int tc_stream_init(struct tc_channel *ch)
+{
+	u32 entries = roundup_pow_of_two(max(ring_entries, 2u));
+	struct capture_data *ddata = ch->tc;
+	struct tc_capture_ring *ring;
+	int i;
+
+	ch->ring_size = PAGE_SIZE + PAGE_ALIGN(entries * sizeof(struct tc_capture_sample));
+	ring = vmalloc_user(ch->ring_size);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->entries = entries;
+	ring->sample_size = sizeof(struct tc_capture_sample);
+	ring->data_offset = PAGE_SIZE;
+	for (i = 0; i < TC_NR_CLOCKS; i++)
+		ring->clock_hz[i] = ddata->clock_hz[i];
+
+	ch->ring = ring;
+	ch->samples = (void *)ring + PAGE_SIZE;
+	ch->ring_mask = entries - 1;
+
+	mutex_init(&ch->read_lock);
+	init_waitqueue_head(&ch->stream_wait);
+	atomic_set(&ch->stream_users, 0);
+
+	snprintf(ch->name, sizeof(ch->name), "tc_capture%d.%u", ddata->id, ch->id);
+	ch->miscdev.minor = MISC_DYNAMIC_MINOR;
+	ch->miscdev.name = ch->name;
+	ch->miscdev.fops = &tc_stream_fops;
+	ch->miscdev.parent = ddata->dev;
+
+	return 0;
+}
+
+/*
+ * XCy of the counting channel y is TIOAx of the capture channel x, the
+ * counter clocks on its rising edges and runs free
+ */
+static void tc_gate_route(struct capture_data *ddata, u32 y, u32 x)
+{
+	u32 bmr = readl(ddata->base + OFFSET_TC_BMR);
+
+	// TCyXCyS: 2 the lower numbered of the other two channels, 3 the higher
+	bmr &= ~(0x3u << (2 * y));
+	bmr |= (x == (y ? 0 : 1) ? 2u : 3u) << (2 * y);
+	writel(bmr, ddata->base + OFFSET_TC_BMR);
+
+	tc_configure(ddata->base, y, TC_CMR_TCCLKS(TC_CMR_TCCLKS_XC0 + y));
+}
+
+/*
+ * Periodic mode: the timer starts a burst every interval_ms, the irq
+ * publishes its result when the burst is complete. A burst still running
+ * at the next tick had no signal, or one slower than the interval, that is
+ * published as period 0.
+ */
+static enum hrtimer_restart tc_periodic_timer(struct hrtimer *timer)
+{
+	struct tc_channel *ch = container_of(timer, struct tc_channel, periodic_timer);
+	void *base = ch->tc->base;
+	unsigned long flags;
+
+	tc_stats_begin(ch, &flags);
+	if (!ch->capture_done)
+		tc_publish(ch, 0, 0, ktime_get_ns());
+
+	tc_stop(base, ch->id);
+	ch->capture_done = 0;
+	ch->buf_counter = 0;
+	tc_enable_irq(base, ch->id);
+	tc_start(base, ch->id);
+	tc_stats_end(ch, flags);
+
+	hrtimer_forward_now(timer, ms_to_ktime(max(READ_ONCE(ch->interval_ms), 1u)));
+	return HRTIMER_RESTART;
+}
+
+// called with ch->lock held
+static int tc_periodic_set(struct tc_channel *ch, unsigned int ms)
+{
+	if (ch->state == TC_PERIODIC && !ms) {
+		hrtimer_cancel(&ch->periodic_timer);
+		tc_stop(ch->tc->base, ch->id);
+		tc_disable_irq(ch->tc->base, ch->id);
+		synchronize_irq(tc_channel_irqno(ch));
+		ch->state = TC_IDLE;
+	} else if (ch->state == TC_IDLE && ms) {
+		ch->capture_done = 1;
+		ch->state = TC_PERIODIC;
+		WRITE_ONCE(ch->interval_ms, ms);
+		hrtimer_start(&ch->periodic_timer, 0, HRTIMER_MODE_REL);
+		return 0;
+	} else if (ch->state != TC_PERIODIC && ms) {
+		return -EBUSY;
+	}
+
+	WRITE_ONCE(ch->interval_ms, ms);
+	return 0;
+}
+
+/*
+ * Each channel is also an iio device with a kfifo buffer, for libiio and
+ * the iio tools. Enabling the buffer attaches it to the stream like the
+ * stream device would, every published result becomes a scan, and the
+ * buffer's watermark decides how many of them a read or poll waits for.
+ * The raw attributes read the latest result.
+ */
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+#define TC_IIO_CHANNEL(idx, what) {					\
+	.type = IIO_COUNT,						\
+	.indexed = 1,							\
+	.channel = idx,							\
+	.extend_name = what,						\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),			\
+	.scan_index = idx,						\
+	.scan_type = {							\
+		.sign = 'u',						\
+		.realbits = 64,						\
+		.storagebits = 64,					\
+		.endianness = IIO_CPU,					\
+	},								\
+}
+
+static const struct iio_chan_spec tc_iio_channels[] = {
+	TC_IIO_CHANNEL(0, "period_ns"),
+	TC_IIO_CHANNEL(1, "high_ns"),
+	IIO_CHAN_SOFT_TIMESTAMP(2),
+};
+
+// tc_iio_push always fills both
+static const unsigned long tc_iio_scan_masks[] = { 0x3, 0 };
+
+static struct tc_channel *tc_iio_channel(struct iio_dev *indio)
+{
+	return *(struct tc_channel **)iio_priv(indio);
+}
+
+static int tc_iio_read_raw(struct iio_dev *indio, struct iio_chan_spec const *chan,
+			   int *val, int *val2, long mask)
+{
+	struct tc_result r;
+	u64 v;
+
+	if (mask != IIO_CHAN_INFO_RAW)
+		return -EINVAL;
+
+	tc_result_read(tc_iio_channel(indio), &r);
+	v = chan->channel ? r.high : r.period;
+	if (v == TC_HIGH_UNKNOWN)
+		v = 0;
+
+	*val = lower_32_bits(v);
+	*val2 = upper_32_bits(v);
+	return IIO_VAL_INT_64;
+}
+
+static const struct iio_info tc_iio_info = {
+	.read_raw = tc_iio_read_raw,
+};
+
+static int tc_iio_postenable(struct iio_dev *indio)
+{
+	struct tc_channel *ch = tc_iio_channel(indio);
+	int ret;
+
+	ret = tc_stream_attach(ch);
+	if (!ret)
+		WRITE_ONCE(ch->iio_on, true);
+
+	return ret;
+}
+
+static int tc_iio_predisable(struct iio_dev *indio)
+{
+	struct tc_channel *ch = tc_iio_channel(indio);
+
+	WRITE_ONCE(ch->iio_on, false);
+	tc_stream_detach(ch);
+
+	return 0;
+}
+
+static const struct iio_buffer_setup_ops tc_iio_buffer_ops = {
+	.postenable = tc_iio_postenable,
+	.predisable = tc_iio_predisable,
+};
+#endif
+
+static void tc_iio_init(struct tc_channel *ch)
+{
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+	struct device *dev = ch->tc->dev;
+	struct iio_dev *indio;
+	int ret;
+
+	indio = devm_iio_device_alloc(dev, sizeof(ch));
+	if (!indio)
+		return;
+
+	*(struct tc_channel **)iio_priv(indio) = ch;
+	indio->name = ch->name;
+	indio->info = &tc_iio_info;
+	indio->modes = INDIO_DIRECT_MODE;
+	indio->channels = tc_iio_channels;
+	indio->num_channels = ARRAY_SIZE(tc_iio_channels);
+	indio->available_scan_masks = tc_iio_scan_masks;
+
+	ret = devm_iio_kfifo_buffer_setup(dev, indio, &tc_iio_buffer_ops);
+	if (!ret)
+		ret = iio_device_register(indio);
+	if (ret) {
+		dev_err(dev, "%s: failed to register the iio device\n", ch->name);
+		return;
+	}
+
+	ch->iio = indio;
+#endif
+}
+
+// before the channel goes, unregistering disables a running buffer
+static void tc_iio_free(struct tc_channel *ch)
+{
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+	if (ch->iio)
+		iio_device_unregister(ch->iio);
+#endif
+	ch->iio = NULL;
+}
+
+// the ring stays until tc_capture_free, a reader may still have it mapped
+static void tc_channel_free(struct capture_data *ddata, struct tc_channel *ch)
+{
+	tc_dma_free(ddata->dev, ch);
+}
+
+static int tc_channel_init(struct capture_data *ddata, u32 id)
+{
+	struct tc_channel *ch = &ddata->ch[id];
+	int ret;
+
+	ch->tc = ddata;
+	ch->id = id;
+	ch->regs = ddata->base + 0x40 * id;
+	mutex_init(&ch->lock);
+	init_waitqueue_head(&ch->wait);
+	spin_lock_init(&ch->stats_lock);
+	seqcount_spinlock_init(&ch->stats_seq, &ch->stats_lock);
+
+	tc_init(ddata->base, id);
+	ch->clksel = TC_CMR_TCCLKS_TIMER_CLOCK2;
+	ch->autorange = true;
+	ch->range_pos = TC_RANGE_NONE;
+
+	INIT_WORK(&ch->mode_work, tc_mode_work);
+	INIT_LIST_HEAD(&ch->measures);
+	mutex_init(&ch->measure_lock);
+	INIT_WORK(&ch->measure_work, tc_measure_work);
+	hrtimer_init(&ch->gate_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ch->gate_timer.function = tc_gate_timer;
+	hrtimer_init(&ch->periodic_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ch->periodic_timer.function = tc_periodic_timer;
+	if (ch->gate_id >= 0)
+		tc_gate_route(ddata, ch->gate_id, id);
+
+	ret = tc_stream_init(ch);
+	if (ret)
+		return ret;
+
+	// a pps edge must reach the kernel when it happens, not a period later
+	if (ch->pps_source)
+		return 0;
+
+	ret = tc_dma_init(ddata->dev, ch);
+	if (ret)
+		tc_channel_free(ddata, ch);
+
+	return ret;
+}
+
+
+/*
+ * The attributes sit both on each channel's misc device and, for the
+ * scripts that predate channels, in the tc_capture group of the platform
+ * device, where they drive the first configured channel.
+ */
+static struct tc_channel *tc_attr_channel(struct device *dev)
+{
+	struct capture_data *ddata;
+	struct miscdevice *misc;
+
+	if (dev_is_platform(dev)) {
+		ddata = dev_get_drvdata(dev);
+		return &ddata->ch[__ffs(ddata->channels)];
+	}
+
+	misc = dev_get_drvdata(dev);
+	return container_of(misc, struct tc_channel, miscdev);
+}
+
+static ssize_t sys_read_frequency(struct device *dev, struct device_attribute *attr,char *buf)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+	struct tc_result r;
+
+	tc_result_read(ch, &r);
+	if (!r.period)
+		return scnprintf(buf, PAGE_SIZE, "0\n");
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",div64_u64(NSEC_PER_SEC + r.period / 2, r.period));
+
+ } 
+ 
+
+static ssize_t sys_read_duty(struct device *dev, struct device_attribute *attr,char *buf)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+	struct tc_result r;
+
+	tc_result_read(ch, &r);
+	if (!r.period || r.high == TC_HIGH_UNKNOWN)
+		return scnprintf(buf, PAGE_SIZE, "0\n");
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", div64_u64(r.high * 1000, r.period));
+ 
+ } 
+ 
+
+
+static ssize_t sys_write_trigger(struct device *dev, struct device_attribute *attr,const char *buf, size_t count) 
+ { 
+	int ret;
+	struct tc_channel *ch = tc_attr_channel(dev);
+	struct capture_data *ddata = ch->tc;
+	unsigned long flags;
+
+
+	if(*buf =='1' ){
+		mutex_lock(&ch->lock);
+		if (ch->state != TC_IDLE) {
+			mutex_unlock(&ch->lock);
+			return -EBUSY;
+		}
+
+		tc_disable_irq(ddata->base, ch->id);
+		tc_start(ddata->base,ch->id);
+		
+		_tcd_capture_polling(ch);
+
+		
+		printk("frequency is %u, pulse is %u\n",ddata->clock_hz[ch->clksel] / ch->buf_b[4], (ch->buf_b[4] - ch->buf_a[4]) * 1000 / ch->buf_b[4]);
+		tc_stop(ddata->base,ch->id);
+		mutex_unlock(&ch->lock);
+	}
+	else if(*buf == '2'){
+
+		mutex_lock(&ch->lock);
+		// the periodic mode keeps the result fresh, just read it
+		if (ch->state == TC_STREAMING || ch->state == TC_PERIODIC) {
+			mutex_unlock(&ch->lock);
+			return -EBUSY;
+		}
+
+		if(ch->state != TC_RUNNING){
+			tc_stop(ddata->base,ch->id);
+			tc_enable_irq(ddata->base,ch->id);
+			tc_start(ddata->base,ch->id);
+
+			ch->capture_done = 0;
+			ch->buf_counter = 0;
+			ch->state = TC_RUNNING;
+		}
+		mutex_unlock(&ch->lock);
+
+		ret = wait_event_interruptible_timeout(ch->wait,
+			ch->capture_done == 1, HZ*5 );
+		
+		// timed out or interrupted, stop the burst so the channel is free again
+		if (ret <= 0) {
+			mutex_lock(&ch->lock);
+			if (ch->state == TC_RUNNING) {
+				tc_stop(ddata->base, ch->id);
+				tc_disable_irq(ddata->base, ch->id);
+				synchronize_irq(tc_channel_irqno(ch));
+				ch->buf_counter = 0;
+				ch->state = TC_IDLE;
+			}
+			mutex_unlock(&ch->lock);
+			if (ret < 0)
+				return ret;
+		}
+		
+		// the irq publishes the result, see tc_burst_publish
+		if(!ret){
+			printk("time out\n");
+			tc_stats_begin(ch, &flags);
+			tc_publish(ch, 0, 0, ktime_get_ns());
+			tc_stats_end(ch, flags);
+		}
+	}
+
+	
+    return count;
+ } 
+
+
+
+static ssize_t sys_read_stats(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+	struct tc_capture_stats st;
+	int i, n;
+
+	tc_stats_snapshot(ch, &st);
+
+	n = scnprintf(buf, PAGE_SIZE,
+		      "count %llu\noverruns %llu\nreranges %u\n"
+		      "min %llu\nmax %llu\nmean %llu.%03llu\nstddev %llu.%03llu\nduty %u\njitter",
+		      st.count, st.overruns, st.reranges, st.min_period, st.max_period,
+		      st.mean_period >> TC_CAPTURE_STATS_FRAC,
+		      ((st.mean_period & 0xff) * 1000) >> TC_CAPTURE_STATS_FRAC,
+		      st.stddev >> TC_CAPTURE_STATS_FRAC,
+		      ((st.stddev & 0xff) * 1000) >> TC_CAPTURE_STATS_FRAC,
+		      st.duty);
+	for (i = 0; i < TC_CAPTURE_JITTER_BINS; i++)
+		n += scnprintf(buf + n, PAGE_SIZE - n, " %llu", st.jitter[i]);
+	n += scnprintf(buf + n, PAGE_SIZE - n, "\n");
+
+	return n;
+}
+
+// any write starts a new statistics window
+static ssize_t sys_write_stats(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	tc_stats_reset(tc_attr_channel(dev));
+
+	return count;
+}
+
+/*
+ * "auto 2 25000000": auto ranging is on and TIMER_CLOCK2 at 25 MHz is in
+ * use. Write "auto", or 1..5 to fix the clock.
+ */
+static ssize_t sys_read_clock(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%s%u %u\n", ch->autorange ? "auto " : "",
+			 ch->clksel + 1, ch->tc->clock_hz[ch->clksel]);
+}
+
+static ssize_t sys_write_clock(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+	unsigned long flags;
+	bool autorange;
+	u32 sel;
+	int ret = count;
+
+	if (sysfs_streq(buf, "auto")) {
+		autorange = true;
+		sel = ch->clksel + 1;
+	} else if (!kstrtou32(buf, 0, &sel) && sel >= 1 && sel <= TC_NR_CLOCKS) {
+		autorange = false;
+	} else {
+		return -EINVAL;
+	}
+	sel--;
+
+	mutex_lock(&ch->lock);
+	if (ch->state == TC_RUNNING || ch->state == TC_PERIODIC) {
+		mutex_unlock(&ch->lock);
+		return -EBUSY;
+	}
+
+	tc_stats_begin(ch, &flags);
+	if (sel == ch->clksel) {
+		ch->autorange = autorange;
+	} else if (ch->state != TC_STREAMING) {
+		tc_set_clock(ch, sel);
+		ch->clksel = sel;
+		ch->autorange = autorange;
+	} else if (tc_range_busy(ch)) {
+		// the last change is still on its way through the stream
+		ret = -EAGAIN;
+	} else {
+		tc_range_switch(ch, sel);
+		ch->autorange = autorange;
+	}
+	tc_stats_end(ch, flags);
+	mutex_unlock(&ch->lock);
+
+	return ret;
+}
+
+static ssize_t sys_read_interval(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+			 ch->state == TC_PERIODIC ? READ_ONCE(ch->interval_ms) : 0);
+}
+
+// a burst every n ms, 0 stops it, frequency and duty follow the result
+static ssize_t sys_write_interval(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+	unsigned int ms;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &ms);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ch->lock);
+	ret = tc_periodic_set(ch, ms);
+	mutex_unlock(&ch->lock);
+
+	return ret ? ret : count;
+}
+
+/*
+ * "period_ns high_ns mono_ns seq" of the latest result, of a burst, a
+ * stream sample or a gate. seq counts the results, a reader polling at
+ * any rate sees whether it got a new one. high_ns is 0 for a gate.
+ */
+static ssize_t sys_read_measurement(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_result r;
+
+	tc_result_read(tc_attr_channel(dev), &r);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu %llu %llu\n", r.period,
+			 r.high == TC_HIGH_UNKNOWN ? 0 : r.high, r.mono, r.seq);
+}
+
+// what a stream is doing: "capture", or "gated" edge counting
+static ssize_t sys_read_mode(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_channel *ch = tc_attr_channel(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%s\n", READ_ONCE(ch->gated) ? "gated" : "capture");
+}
+
+static DEVICE_ATTR(trigger, S_IRUGO | S_IWUSR,NULL,sys_write_trigger);
+static DEVICE_ATTR(frequency, S_IRUGO | S_IRUSR,sys_read_frequency,NULL);
+static DEVICE_ATTR(duty, S_IRUGO | S_IRUSR,sys_read_duty,NULL);
+static DEVICE_ATTR(stats, S_IRUGO | S_IWUSR, sys_read_stats, sys_write_stats);
+static DEVICE_ATTR(clock, S_IRUGO | S_IWUSR, sys_read_clock, sys_write_clock);
+static DEVICE_ATTR(mode, S_IRUGO, sys_read_mode, NULL);
+static DEVICE_ATTR(interval_ms, S_IRUGO | S_IWUSR, sys_read_interval, sys_write_interval);
+static DEVICE_ATTR(measurement, S_IRUGO, sys_read_measurement, NULL);
+ 
+static struct attribute *tc_capture_attrs[]={
+	&dev_attr_trigger.attr,
+	&dev_attr_frequency.attr,
+	&dev_attr_duty.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_clock.attr,
+	&dev_attr_mode.attr,
+	&dev_attr_interval_ms.attr,
+	&dev_attr_measurement.attr,
+	NULL,
+};
+
+
+
+
+struct attribute_group tc_group={
+	.attrs = tc_capture_attrs,
+	.name = "tc_capture",
+};
+
+static const struct attribute_group tc_channel_group = {
+	.attrs = tc_capture_attrs,
+};
+
+static const struct attribute_group *tc_channel_groups[] = {
+	&tc_channel_group,
+	NULL,
+};
+
+static struct tc_qdec *tc_qdec_file(struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+
+	return container_of(misc, struct tc_qdec, miscdev);
+}
+
+// a new reader starts with the events that come after the open
+static int tc_qdec_open(struct inode *inode, struct file *file)
+{
+	struct tc_qdec *q = tc_qdec_file(file);
+
+	mutex_lock(&q->read_lock);
+	kfifo_reset_out(&q->events);
+	mutex_unlock(&q->read_lock);
+
+	return 0;
+}
+
+static ssize_t tc_qdec_read(struct file *file, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct tc_qdec *q = tc_qdec_file(file);
+	size_t sz = sizeof(struct tc_qdec_event);
+	unsigned int copied;
+	ssize_t ret;
+
+	if (count < sz)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&q->read_lock))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&q->events)) {
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		ret = wait_event_interruptible(q->wait, !kfifo_is_empty(&q->events));
+		if (ret)
+			goto out;
+	}
+
+	ret = kfifo_to_user(&q->events, buf, count - count % sz, &copied);
+	if (!ret)
+		ret = copied;
+out:
+	mutex_unlock(&q->read_lock);
+	return ret;
+}
+
+static __poll_t tc_qdec_poll(struct file *file, poll_table *wait)
+{
+	struct tc_qdec *q = tc_qdec_file(file);
+
+	poll_wait(file, &q->wait, wait);
+
+	if (!kfifo_is_empty(&q->events))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations tc_qdec_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tc_qdec_open,
+	.read		= tc_qdec_read,
+	.poll		= tc_qdec_poll,
+	.llseek		= noop_llseek,
+};
+
+static struct tc_qdec *tc_attr_qdec(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct tc_qdec, miscdev);
+}
+
+static ssize_t sys_read_position(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_qdec *q = tc_attr_qdec(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (s32)readl(q->tc->base + OFFSET_TC_CV));
+}
+
+static ssize_t sys_read_revolutions(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_qdec *q = tc_attr_qdec(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (s32)readl(q->tc->base + 0x40 + OFFSET_TC_CV));
+}
+
+static ssize_t sys_read_direction(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_qdec *q = tc_attr_qdec(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%s\n",
+			 readl(q->tc->base + OFFSET_TC_QSR) & TC_QSR_DIR ? "reverse" : "forward");
+}
+
+/*
+ * edges per second, the mean since the previous read. Reads less than a
+ * millisecond apart get the previous value, the first one 0.
+ */
+static ssize_t sys_read_speed(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tc_qdec *q = tc_attr_qdec(dev);
+	u64 now;
+	s32 pos;
+	s64 speed;
+
+	mutex_lock(&q->speed_lock);
+	now = ktime_get_ns();
+	pos = readl(q->tc->base + OFFSET_TC_CV);
+	if (now - q->speed_ns >= NSEC_PER_MSEC) {
+		q->speed = q->speed_ns ? div64_s64((s64)(s32)(pos - q->speed_pos) * NSEC_PER_SEC,
+						  now - q->speed_ns) : 0;
+		q->speed_pos = pos;
+		q->speed_ns = now;
+	}
+	speed = q->speed;
+	mutex_unlock(&q->speed_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", speed);
+}
+
+static DEVICE_ATTR(position, S_IRUGO, sys_read_position, NULL);
+static DEVICE_ATTR(revolutions, S_IRUGO, sys_read_revolutions, NULL);
+static DEVICE_ATTR(direction, S_IRUGO, sys_read_direction, NULL);
+static DEVICE_ATTR(speed, S_IRUGO, sys_read_speed, NULL);
+
+static struct attribute *tc_qdec_attrs[] = {
+	&dev_attr_position.attr,
+	&dev_attr_revolutions.attr,
+	&dev_attr_direction.attr,
+	&dev_attr_speed.attr,
+	NULL,
+};
+
+static const struct attribute_group tc_qdec_group = {
+	.attrs = tc_qdec_attrs,
+};
+
+static const struct attribute_group *tc_qdec_groups[] = {
+	&tc_qdec_group,
+	NULL,
+};
+
+static void tc_qdec_init(struct capture_data *ddata)
+{
+	struct tc_qdec *q = ddata->qdec;
+
+	q->tc = ddata;
+	INIT_KFIFO(q->events);
+	mutex_init(&q->read_lock);
+	mutex_init(&q->speed_lock);
+	init_waitqueue_head(&q->wait);
+
+	snprintf(q->name, sizeof(q->name), "tc_qdec%d", ddata->id);
+	q->miscdev.minor = MISC_DYNAMIC_MINOR;
+	q->miscdev.name = q->name;
+	q->miscdev.fops = &tc_qdec_fops;
+	q->miscdev.parent = ddata->dev;
+	q->miscdev.groups = tc_qdec_groups;
+
+	writel(TC_QIDR_IDX | TC_QIDR_DIRCHG | TC_QIDR_QERR, ddata->base + OFFSET_TC_QIDR);
+}
+
+/*
+ * Both channels count XC0, which the decoder drives: channel 0 every edge
+ * of PHA and PHB, up or down, channel 1 the index pulses. Neither resets
+ * on the index, so the position is absolute and the speed is a difference
+ * of two reads.
+ */
+static void tc_qdec_start(struct capture_data *ddata)
+{
+	void __iomem *base = ddata->base;
+	u32 bmr;
+
+	bmr = readl(base + OFFSET_TC_BMR);
+	bmr &= ~(TC_BMR_QDEN | TC_BMR_POSEN | TC_BMR_SPEEDEN | TC_BMR_EDGPHA |
+		 TC_BMR_MAXFILT_Msk);
+	bmr |= TC_BMR_QDEN | TC_BMR_POSEN | TC_BMR_MAXFILT(ddata->qdec->filter);
+	writel(bmr, base + OFFSET_TC_BMR);
+
+	tc_configure(base, 0, TC_CMR_TCCLKS(TC_CMR_TCCLKS_XC0));
+	tc_configure(base, 1, TC_CMR_TCCLKS(TC_CMR_TCCLKS_XC0));
+	tc_start(base, 0);
+	tc_start(base, 1);
+
+	readl(base + OFFSET_TC_QISR);
+	writel(TC_QIER_IDX | TC_QIER_DIRCHG, base + OFFSET_TC_QIER);
+}
+
+static void tc_qdec_stop(struct capture_data *ddata)
+{
+	void __iomem *base = ddata->base;
+
+	writel(TC_QIDR_IDX | TC_QIDR_DIRCHG | TC_QIDR_QERR, base + OFFSET_TC_QIDR);
+	tc_stop(base, 0);
+	tc_stop(base, 1);
+	writel(readl(base + OFFSET_TC_BMR) & ~(TC_BMR_QDEN | TC_BMR_POSEN),
+	       base + OFFSET_TC_BMR);
+}
+
+/*
+ * "microchip,channels" lists the channels to capture on, <0> when it is
+ * missing. "microchip,count-channels" optionally gives each of them, in the
+ * same order, an unused channel of the block for gated counting, and
+ * "microchip,pps-channels" the ones that are PPS sources. With
+ * "microchip,qdec" channels 0 and 1 are the quadrature decoder, a missing
+ * microchip,channels is no capture channel then. The TC has either one
+ * interrupt for the block, shared by the channels, or one per channel in
+ * channel order.
+ */
+static int tc_capture_parse_dt(struct platform_device *pdev, struct capture_data *ddata)
+{
+	struct device_node *np = pdev->dev.of_node;
+	u32 ids[TC_MAX_CHANNELS], cnt[TC_MAX_CHANNELS], pps[TC_MAX_CHANNELS];
+	u32 used, qdec_mask = 0;
+	int n, m, i;
+
+	if (of_property_read_bool(np, "microchip,qdec")) {
+		ddata->qdec = devm_kzalloc(&pdev->dev, sizeof(*ddata->qdec), GFP_KERNEL);
+		if (!ddata->qdec)
+			return -ENOMEM;
+		of_property_read_u32(np, "microchip,qdec-filter", &ddata->qdec->filter);
+		if (ddata->qdec->filter > 63) {
+			dev_err(&pdev->dev, "bad microchip,qdec-filter\n");
+			return -EINVAL;
+		}
+		qdec_mask = BIT(0) | BIT(1);
+	}
+
+	n = of_property_read_variable_u32_array(np, "microchip,channels", ids,
+						1, TC_MAX_CHANNELS);
+	if (n == -EINVAL) {
+		ids[0] = 0;
+		n = qdec_mask ? 0 : 1;
+	} else if (n < 0) {
+		dev_err(&pdev->dev, "bad microchip,channels\n");
+		return n;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (ids[i] >= TC_MAX_CHANNELS || (qdec_mask & BIT(ids[i])))
+			return -EINVAL;
+		ddata->channels |= BIT(ids[i]);
+	}
+
+	for (i = 0; i < TC_MAX_CHANNELS; i++)
+		ddata->ch[i].gate_id = -1;
+
+	m = of_property_read_variable_u32_array(np, "microchip,count-channels", cnt,
+						1, TC_MAX_CHANNELS);
+	if (m > 0) {
+		used = ddata->channels | qdec_mask;
+		for (i = 0; i < min(m, n); i++) {
+			if (cnt[i] >= TC_MAX_CHANNELS || (used & BIT(cnt[i]))) {
+				dev_err(&pdev->dev, "bad microchip,count-channels\n");
+				return -EINVAL;
+			}
+			used |= BIT(cnt[i]);
+			ddata->ch[ids[i]].gate_id = cnt[i];
+		}
+	}
+
+	m = of_property_read_variable_u32_array(np, "microchip,pps-channels", pps,
+						1, TC_MAX_CHANNELS);
+	for (i = 0; i < m; i++) {
+		if (pps[i] >= TC_MAX_CHANNELS || !(ddata->channels & BIT(pps[i]))) {
+			dev_err(&pdev->dev, "bad microchip,pps-channels\n");
+			return -EINVAL;
+		}
+		ddata->ch[pps[i]].pps_source = true;
+	}
+
+#ifdef TC_CAPTURE_SIM
+	tc_sim_parse(ddata);
+	return 0;
+#endif
+
+	ddata->nr_irqs = platform_irq_count(pdev);
+	if (ddata->nr_irqs < 0)
+		return ddata->nr_irqs;
+	if (ddata->nr_irqs != 1 && ddata->nr_irqs < TC_MAX_CHANNELS)
+		return -ENODEV;
+	ddata->nr_irqs = min(ddata->nr_irqs, TC_MAX_CHANNELS);
+
+	for (i = 0; i < ddata->nr_irqs; i++) {
+		ddata->irq[i] = platform_get_irq(pdev, i);
+		if (ddata->irq[i] < 0)
+			return -ENODEV;
+	}
+
+	return 0;
+}
+
+static int tc_capture_request_irqs(struct platform_device *pdev, struct capture_data *ddata)
+{
+	struct tc_channel *ch;
+	int ret;
+
+#ifdef TC_CAPTURE_SIM
+	// the model's timer calls tc_block_interrupt
+	return 0;
+#endif
+
+	if (ddata->nr_irqs == 1)
+		return devm_request_irq(&pdev->dev, ddata->irq[0], tc_block_interrupt,
+					0, dev_name(&pdev->dev), ddata);
+
+	// the decoder interrupts on channel 0's line
+	if (ddata->qdec) {
+		ret = devm_request_irq(&pdev->dev, ddata->irq[0], tc_qdec_interrupt,
+				       0, ddata->qdec->name, ddata->qdec);
+		if (ret)
+			return ret;
+	}
+
+	for_each_tc_channel(ddata, ch) {
+		ret = devm_request_irq(&pdev->dev, ddata->irq[ch->id], tc_interrupt,
+				       0, ch->name, ch);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * TIMER_CLOCK5 comes from the "slow_clk" clock when the device tree names
+ * one, it is the 32768 Hz crystal otherwise
+ */
+static int tc_capture_clocks(struct platform_device *pdev, struct capture_data *ddata)
+{
+	struct clk *slow;
+	u32 i;
+
+	slow = devm_clk_get_optional(&pdev->dev, "slow_clk");
+	if (IS_ERR(slow))
+		return PTR_ERR(slow);
+
+	for (i = 0; i < TC_NR_CLOCKS; i++) {
+		if (i < ARRAY_SIZE(tc_clock_div))
+			ddata->clock_hz[i] = ddata->clk_rate / tc_clock_div[i];
+		else
+			ddata->clock_hz[i] = slow ? clk_get_rate(slow) : 32768;
+		if (!ddata->clock_hz[i])
+			return -EINVAL;
+
+		// mul_u64_u32_shr does not overflow, 1 s is only for the shift
+		clocks_calc_mult_shift(&ddata->clock_mult[i], &ddata->clock_shift[i],
+				       ddata->clock_hz[i], NSEC_PER_SEC, 1);
+	}
+
+	return 0;
+}
+
+static int tc_capture_probe(struct platform_device *pdev)
+{
+	struct resource *res;
+	struct capture_data *ddata;
+	struct tc_channel *ch;
+	int err,ret;
+	unsigned long clk_rate;
+
+	debug_print("\ntc_capture_probe\n");
+
+	
+	ddata = kzalloc(sizeof(*ddata), GFP_KERNEL);
+	if (!ddata)
+		return -ENOMEM;
+	kref_init(&ddata->ref);
+	// dropped after the devm irqs are freed, the files hold their own
+	err = devm_add_action_or_reset(&pdev->dev, tc_capture_release, ddata);
+	if (err)
+		return err;
+
+	platform_set_drvdata(pdev, ddata);
+	ddata->dev = &pdev->dev;
+	
+
+#ifdef TC_CAPTURE_SIM
+	ddata->base = tc_sim_attach(ddata);
+#else
+	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	ddata->base = devm_ioremap_resource(&pdev->dev, res);
+	if (IS_ERR(ddata->base))
+		return PTR_ERR(ddata->base);
+	ddata->phys_base = res->start;
+#endif
+
+	ret = tc_capture_parse_dt(pdev, ddata);
+	if (ret)
+		return ret;
+
+	
+
+#ifdef TC_CAPTURE_SIM
+	ddata->clk = NULL;
+	ddata->clk_rate = clk_rate = sim_clk_hz;
+#else
+	ddata->clk = devm_clk_get(&pdev->dev, NULL);
+	if (IS_ERR(ddata->clk))
+		return PTR_ERR(ddata->clk);
+
+
+
+	ddata->clk_rate = clk_rate = clk_get_rate(ddata->clk);
+#endif
+	debug_print("get clk rate %ld\n",clk_rate);
+
+	ret = tc_capture_clocks(pdev, ddata);
+	if (ret)
+		return ret;
+	
+	err = clk_prepare_enable(ddata->clk);
+	if (err)
+		return err;
+
+	ddata->id = ida_alloc(&tc_ida, GFP_KERNEL);
+	if (ddata->id < 0) {
+		ret = ddata->id;
+		goto clk_err;
+	}
+
+	for_each_tc_channel(ddata, ch)
+		tc_disable_irq(ddata->base, ch - ddata->ch);
+
+	for_each_tc_channel(ddata, ch) {
+		ret = tc_channel_init(ddata, ch - ddata->ch);
+		if (ret)
+			goto channel_err;
+	}
+
+	if (ddata->qdec)
+		tc_qdec_init(ddata);
+
+
+	ret = tc_capture_request_irqs(pdev, ddata);
+	if (ret) {
+		dev_err(&pdev->dev, "Failed to allocate IRQ.\n");
+		goto channel_err;
+	}	
+
+	for_each_tc_channel(ddata, ch) {
+		ch->miscdev.groups = tc_channel_groups;
+		ret = misc_register(&ch->miscdev);
+		if (ret) {
+			dev_err(&pdev->dev, "Failed to register %s.\n", ch->name);
+			goto misc_err;
+		}
+	}
+
+	if (ddata->channels) {
+		snprintf(ddata->measure_name, sizeof(ddata->measure_name),
+			 "tc_measure%d", ddata->id);
+		ddata->measure_dev.minor = MISC_DYNAMIC_MINOR;
+		ddata->measure_dev.name = ddata->measure_name;
+		ddata->measure_dev.fops = &tc_measure_fops;
+		ddata->measure_dev.parent = ddata->dev;
+		ret = misc_register(&ddata->measure_dev);
+		if (ret) {
+			dev_err(&pdev->dev, "Failed to register %s.\n", ddata->measure_name);
+			goto misc_err;
+		}
+	}
+
+	if (ddata->qdec) {
+		ret = misc_register(&ddata->qdec->miscdev);
+		if (ret) {
+			dev_err(&pdev->dev, "Failed to register %s.\n", ddata->qdec->name);
+			goto misc_err;
+		}
+		tc_qdec_start(ddata);
+	}
+
+
+	// the group drives the first capture channel, a decoder alone has none
+	if(ddata->channels && sysfs_create_group(&pdev->dev.kobj, &tc_group) != 0)
+	{
+		printk("create %s sys-file err \n",tc_group.name);
+	}
+
+	for_each_tc_channel(ddata, ch) {
+		if (ch->pps_source)
+			tc_pps_init(ch);
+		tc_iio_init(ch);
+	}
+
+
+	return 0;
+
+misc_err:
+	if (!IS_ERR_OR_NULL(ddata->measure_dev.this_device))
+		misc_deregister(&ddata->measure_dev);
+	for_each_tc_channel(ddata, ch) {
+		if (!IS_ERR_OR_NULL(ch->miscdev.this_device))
+			misc_deregister(&ch->miscdev);
+	}
+channel_err:
+	for_each_tc_channel(ddata, ch)
+		tc_channel_free(ddata, ch);
+	ida_free(&tc_ida, ddata->id);
+clk_err:
+	clk_disable_unprepare(ddata->clk);
+	return ret;
+}
+
+
+
+static int tc_capture_remove(struct platform_device *pdev)
+{
+	struct capture_data *ddata = platform_get_drvdata(pdev);
+	struct tc_channel *ch;
+	int ret = 0;
+	int i;
+
+	if (ddata->channels)
+		sysfs_remove_group(&pdev->dev.kobj, &tc_group);
+
+	if (ddata->qdec) {
+		tc_qdec_stop(ddata);
+		misc_deregister(&ddata->qdec->miscdev);
+	}
+	if (ddata->channels)
+		misc_deregister(&ddata->measure_dev);
+
+	// an open file or a measure request no longer starts a stream
+	ddata->gone = true;
+		
+	for_each_tc_channel(ddata, ch) {
+		cancel_work_sync(&ch->measure_work);
+		tc_iio_free(ch);
+		tc_pps_free(ch);
+		hrtimer_cancel(&ch->periodic_timer);
+		misc_deregister(&ch->miscdev);
+
+		// a reader still has it open, stop the irqs and the cyclic dma
+		mutex_lock(&ch->lock);
+		if (ch->state == TC_STREAMING)
+			tc_stream_stop(ch);
+		mutex_unlock(&ch->lock);
+
+		// a gated stream's gate and a pending switch back to capture
+		hrtimer_cancel(&ch->gate_timer);
+		cancel_work_sync(&ch->mode_work);
+
+		tc_stop(ddata->base, ch->id);
+		tc_disable_irq(ddata->base, ch->id);
+		if (ch->gate_id >= 0)
+			tc_stop(ddata->base, ch->gate_id);
+	}
+
+	// the irqs are devm, make sure none is still running
+	for (i = 0; i < ddata->nr_irqs; i++)
+		synchronize_irq(ddata->irq[i]);
+
+	for_each_tc_channel(ddata, ch)
+		tc_channel_free(ddata, ch);
+
+	ida_free(&tc_ida, ddata->id);
+	clk_disable_unprepare(ddata->clk);
+#ifdef TC_CAPTURE_SIM
+	tc_sim_detach();
+#endif
+	
+	return ret;
+}
+
+static const struct of_device_id tc_capture_of_match[] = {
+	{ .compatible = "microchip,tc-capture" },
+	{ .compatible = "sama7g54,tc-capture" },
+	{ /* sentinel */ }
+};
+MODULE_DEVICE_TABLE(of, tc_capture_of_match);
+
+
+
+static struct platform_driver tc_capture_driver = {
+	.probe	= tc_capture_probe,
+	.remove		= tc_capture_remove,
+	.driver	= {
+		.name		= "microchip_tc_capure",
+		.of_match_table	= tc_capture_of_match,
+	},
+};
+
+#ifdef TC_CAPTURE_SIM
+// no device tree to create the device, the module brings its own
+static struct platform_device *tc_sim_pdev;
+
+static int __init tc_capture_init(void)
+{
+	int ret;
+
+	ret = tc_sim_create();
+	if (ret)
+		return ret;
+
+	ret = platform_driver_register(&tc_capture_driver);
+	if (ret)
+		goto sim_err;
+
+	tc_sim_pdev = platform_device_register_simple(tc_capture_driver.driver.name,
+						      -1, NULL, 0);
+	if (IS_ERR(tc_sim_pdev)) {
+		ret = PTR_ERR(tc_sim_pdev);
+		platform_driver_unregister(&tc_capture_driver);
+		goto sim_err;
+	}
+
+	return 0;
+
+sim_err:
+	tc_sim_destroy();
+	return ret;
+}
+module_init(tc_capture_init);
+
+static void __exit tc_capture_exit(void)
+{
+	platform_device_unregister(tc_sim_pdev);
+	platform_driver_unregister(&tc_capture_driver);
+	tc_sim_destroy();
+}
+module_exit(tc_capture_exit);
+#else
+module_platform_driver(tc_capture_driver);
+#endif
+
+MODULE_AUTHOR("murphy.xu");
+MODULE_DESCRIPTION("microchip tc capture driver");
+MODULE_LICENSE("GPL v2");
+
@@ -0,0 +1,162 @@
+#ifndef __TC_CAPTURE_H
+#define __TC_CAPTURE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * user interface of the tc_capture stream devices
+ *
+ * Every channel listed in microchip,channels has its own device,
+ * /dev/tc_capture<instance>.<channel>, with its own ring. Opening the
+ * device starts continuous capture, closing it stops it. Every RA/RB pair
+ * the channel loads ends up as one struct tc_capture_sample in a
+ * ring that the interrupt fills. The ring can be consumed with read(), or
+ * mapped read only: struct tc_capture_ring sits at offset 0 and the samples
+ * start at data_offset. An mmap reader processes samples[tail % entries] up
+ * to head and then hands them back with TC_CAPTURE_IOC_CONSUME, so there is
+ * one syscall per batch instead of one per sample.
+ *
+ * The driver never overwrites a sample that was not consumed, when the ring
+ * is full new samples are counted in dropped instead.
+ *
+ * The counter clock follows the input: with auto ranging (the clock sysfs
+ * file) the driver moves to the fastest TIMER_CLOCK a period fits in while
+ * the stream runs. Every sample names its clock, TC_SAMPLE_CLOCK(flags) is
+ * the index into clock_hz. The period in which the clock changed is still
+ * in the ring, flagged TC_SAMPLE_RERANGE, its values mix two clocks. The
+ * 32 bit counter is extended by counting its overflows, the full values
+ * are ra_hi << 32 | ra and rb_hi << 32 | rb.
+ *
+ * Above the gate_hz module parameter a channel that has a counting channel
+ * in microchip,count-channels stops capturing edges and counts them over a
+ * gate of gate_ms instead, and goes back to capture below half of it. Those
+ * samples are flagged TC_SAMPLE_GATED: ra is the number of rising edges
+ * counted, rb the gate length in ns, the frequency is ra * 10^9 / rb.
+ *
+ * mono_ns and real_ns date the falling edge that ends the period (the end
+ * of a gate). The system time is taken at irq entry together with the
+ * counter, which started at the last falling edge, so that edge is dated to
+ * within the two reads; edges between two such anchors are dated by adding
+ * up the periods. The rising edge is rb - ra ticks before the falling one.
+ */
+
+#define TC_SAMPLE_OVERRUN	(1 << 0)	/* TC_SR_LOVRS, an edge was lost before this one */
+#define TC_SAMPLE_RERANGE	(1 << 1)	/* the clock changed during this period */
+#define TC_SAMPLE_GATED		(1 << 2)	/* edges counted over a gate, see above */
+#define TC_SAMPLE_CLOCK_SHIFT	4
+#define TC_SAMPLE_CLOCK(flags)	(((flags) >> TC_SAMPLE_CLOCK_SHIFT) & 0x7)
+
+#define TC_CAPTURE_CLOCKS	5	/* TIMER_CLOCK1..5 */
+
+struct tc_capture_sample {
+	__u32 ra;		/* counter at the rising edge, the low time */
+	__u32 rb;		/* counter at the falling edge, the period */
+	__u32 flags;
+	__u16 ra_hi;		/* counter overflows */
+	__u16 rb_hi;
+	__u64 mono_ns;		/* CLOCK_MONOTONIC */
+	__u64 real_ns;		/* CLOCK_REALTIME */
+};
+
+struct tc_capture_ring {
+	__u32 head;		/* written by the driver, samples produced */
+	__u32 tail;		/* written by the driver, samples consumed */
+	__u32 entries;		/* power of two */
+	__u32 sample_size;
+	__u32 data_offset;	/* of samples[0] from the start of the mapping */
+	__u32 dropped;		/* samples lost to a full ring */
+	__u32 clock_hz[TC_CAPTURE_CLOCKS];	/* ra and rb are in ticks of these */
+	__u32 reserved[5];
+};
+
+#define TC_CAPTURE_JITTER_BINS	32
+#define TC_CAPTURE_STATS_FRAC	8	/* fractional bits of mean_period and stddev */
+
+/*
+ * running statistics of a channel since the stream was opened or the stats
+ * sysfs file was written, over every period the channel captured. Periods
+ * are converted from the clock they were measured with, so the times are
+ * in ns, and the TC_SAMPLE_RERANGE periods are left out. A gate counts as
+ * one period, the mean one over the gate, with no high time.
+ */
+struct tc_capture_stats {
+	__u64 count;		/* periods */
+	__u64 overruns;		/* periods flagged TC_SAMPLE_OVERRUN */
+	__u64 min_period;	/* ns */
+	__u64 max_period;
+	__u64 mean_period;	/* ns << TC_CAPTURE_STATS_FRAC */
+	__u64 stddev;		/* ns << TC_CAPTURE_STATS_FRAC */
+	__u64 sum_period;	/* ns */
+	__u64 sum_high;		/* of the periods that are not gates */
+	__u32 duty;		/* per mille, sum_high over the periods it was measured in */
+	__u32 reranges;		/* clock changes */
+	/*
+	 * |period - previous period| in ns: jitter[0] counts equal periods,
+	 * jitter[n] differences in [2^(n-1), 2^n), the last bin also
+	 * everything above
+	 */
+	__u64 jitter[TC_CAPTURE_JITTER_BINS];
+};
+
+/*
+ * quadrature decoder, /dev/tc_qdec<instance>
+ *
+ * With microchip,qdec channels 0 and 1 of the TC decode an encoder on
+ * PHA (TIOA0), PHB (TIOB0) and the index (TIOB1), the counting is done
+ * by the hardware. The position, revolutions, direction and speed sysfs
+ * files of the device read the counters. The only interrupts are the
+ * index and direction changes, read() returns them as struct
+ * tc_qdec_event. position counts every edge of PHA and PHB and is not
+ * reset by the index, revolutions counts the index pulses.
+ */
+
+#define TC_QDEC_INDEX		0
+#define TC_QDEC_DIRECTION	1
+
+#define TC_QDEC_REVERSE		(1 << 0)	/* counting down */
+#define TC_QDEC_LOST		(1 << 1)	/* events before this one were lost */
+
+struct tc_qdec_event {
+	__u32 type;
+	__u32 flags;
+	__s32 position;		/* at the event */
+	__s32 revolutions;
+	__u64 mono_ns;		/* CLOCK_MONOTONIC of the interrupt */
+};
+
+/*
+ * measurement requests, /dev/tc_measure<instance>
+ *
+ * A client write()s any number of struct tc_measure_req and gets a struct
+ * tc_measure_done for each from read() once it completes, in completion
+ * order. poll() reports completions, TC_CAPTURE_IOC_EVENTFD also signals
+ * an eventfd for each, -1 turns that off. Nothing blocks while a request
+ * runs, and any number of clients can have requests on the same channel:
+ * they all count the periods the channel measures from their submission
+ * on. An idle channel streams while it has requests, one that already
+ * streams, or runs periodic or one shot bursts, is shared as it is.
+ */
+struct tc_measure_req {
+	__u64 user_data;	/* echoed back in tc_measure_done */
+	__u32 channel;		/* of this TC instance */
+	__u32 periods;		/* to average, at least 1 */
+	__u32 timeout_ms;	/* 0 is 5000 */
+	__u32 reserved;
+};
+
+struct tc_measure_done {
+	__u64 user_data;
+	__s32 status;		/* 0, -ETIMEDOUT */
+	__u32 periods;		/* measured, less than asked on a timeout */
+	__u64 period_ns;	/* mean */
+	__u64 high_ns;		/* mean, 0 if only gates were measured */
+	__u64 mono_ns;		/* CLOCK_MONOTONIC of the last period */
+};
+
+#define TC_CAPTURE_IOC_MAGIC	'T'
+#define TC_CAPTURE_IOC_CONSUME	_IOW(TC_CAPTURE_IOC_MAGIC, 1, __u32)
+#define TC_CAPTURE_IOC_STATS	_IOR(TC_CAPTURE_IOC_MAGIC, 2, struct tc_capture_stats)
+#define TC_CAPTURE_IOC_EVENTFD	_IOW(TC_CAPTURE_IOC_MAGIC, 3, __s32)
+
+#endif
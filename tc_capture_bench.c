@@ -0,0 +1,378 @@
+/*
+ * capture benchmark for tc_capture, against the simulated TC
+ *
+ * gcc -O2 -Wall -o tc_capture_bench tc_capture_bench.c -lm
+ *
+ * The module has to be built with -DTC_CAPTURE_SIM (see tc_capture_sim.h)
+ * and debugfs mounted. For each capture mode the input frequency is swept
+ * through sim_hz and the bench prints the samples per second it got, the
+ * overruns and ring drops, the handler time per sample from the simulator
+ * and the error of the measured period against the simulated one. The
+ * last line of each mode is the fastest edge rate it kept up with.
+ *
+ *   stream    /dev/tc_capture0.0 in capture mode, every period
+ *   gated     the same device above gate_hz, edges counted over gate_ms
+ *   periodic  the interval_ms burst measurement, read from sysfs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "tc_capture.h"
+
+#define PARAM_DIR	"/sys/module/tc_capture/parameters/"
+#define SIM_DIR		"/sys/kernel/debug/tc_capture_sim/"
+#define CHANNEL_DIR	"/sys/class/misc/tc_capture0.0/"
+
+#define SETTLE_MS	200
+
+static const unsigned int rates[] = {
+	100, 1000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+	1000000, 2000000, 5000000,
+};
+
+enum { MODE_STREAM, MODE_GATED, MODE_PERIODIC };
+
+static const char *const mode_names[] = { "stream", "gated", "periodic" };
+
+struct result {
+	double samples_s;
+	uint64_t overruns;	/* or periodic bursts that did not complete */
+	uint64_t dropped;
+	double irq_ns;		/* handler time per sample */
+	double err_ppm;		/* of the mean period */
+	double max_ppm;		/* worst single period */
+};
+
+static const char *dev = "/dev/tc_capture0.0";
+static int duration_ms = 1000;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+static int write_u64(const char *path, uint64_t v)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fprintf(f, "%llu\n", (unsigned long long)v);
+	if (fclose(f)) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_u64s(const char *path, uint64_t *v, int n)
+{
+	unsigned long long x;
+	FILE *f = fopen(path, "r");
+	int i;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (fscanf(f, "%llu", &x) != 1)
+			break;
+		v[i] = x;
+	}
+	fclose(f);
+	return i == n ? 0 : -1;
+}
+
+static uint64_t read_u64(const char *path)
+{
+	uint64_t v = 0;
+
+	read_u64s(path, &v, 1);
+	return v;
+}
+
+static double ppm(double v, double ref)
+{
+	return (v - ref) / ref * 1e6;
+}
+
+// the simulator and its irq accounting, from here on
+static uint64_t sim_start(unsigned int hz)
+{
+	write_u64(PARAM_DIR "sim_hz", hz);
+	sleep_ms(SETTLE_MS);
+	write_u64(SIM_DIR "irq_ns", 0);
+	write_u64(SIM_DIR "irq_count", 0);
+
+	return read_u64(SIM_DIR "period_ns");
+}
+
+static void sim_result(struct result *r, uint64_t samples, uint64_t ns)
+{
+	r->samples_s = ns ? samples * 1e9 / ns : 0;
+	r->irq_ns = samples ? (double)read_u64(SIM_DIR "irq_ns") / samples : 0;
+}
+
+/*
+ * Reads the stream through the mapped ring, the way a consumer that keeps
+ * up would. The samples of the first SETTLE_MS are thrown away, the clock
+ * auto ranging and the switch to gated counting happen in there.
+ */
+static int run_stream(unsigned int hz, int gated, struct result *r)
+{
+	volatile struct tc_capture_ring *ring;
+	const struct tc_capture_sample *s;
+	struct pollfd pfd;
+	uint64_t truth, t0, t1, end, samples = 0, used = 0;
+	uint32_t head, tail, dropped, n;
+	double period, sum = 0, worst = 0;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t size;
+	void *map;
+	int fd;
+
+	write_u64(PARAM_DIR "gate_hz", gated ? 1 : UINT32_MAX);
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		return -1;
+	}
+
+	// the header says how large the whole mapping is
+	map = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+	ring = map;
+	size = ring->data_offset + (size_t)ring->entries * ring->sample_size;
+	munmap(map, page);
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+	ring = map;
+
+	truth = sim_start(hz);
+	n = ring->head - ring->tail;
+	if (n)
+		ioctl(fd, TC_CAPTURE_IOC_CONSUME, &n);
+
+	memset(r, 0, sizeof(*r));
+	dropped = ring->dropped;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	t0 = now_ns();
+	end = t0 + duration_ms * 1000000ull;
+
+	while (now_ns() < end) {
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		head = ring->head;
+		__sync_synchronize();
+		for (tail = ring->tail; tail != head; tail++) {
+			s = (const void *)((const char *)map + ring->data_offset +
+					   (size_t)(tail & (ring->entries - 1)) *
+					   ring->sample_size);
+			samples++;
+			if (s->flags & TC_SAMPLE_OVERRUN)
+				r->overruns++;
+			if ((s->flags & TC_SAMPLE_RERANGE) ||
+			    !!(s->flags & TC_SAMPLE_GATED) != gated)
+				continue;
+
+			if (gated) {
+				if (!s->ra)
+					continue;
+				period = (double)s->rb / s->ra;
+			} else {
+				period = (double)((uint64_t)s->rb_hi << 32 | s->rb) * 1e9 /
+					 ring->clock_hz[TC_SAMPLE_CLOCK(s->flags)];
+			}
+			sum += period;
+			used++;
+			if (fabs(ppm(period, truth)) > fabs(worst))
+				worst = ppm(period, truth);
+		}
+
+		n = head - ring->tail;
+		if (n)
+			ioctl(fd, TC_CAPTURE_IOC_CONSUME, &n);
+	}
+	t1 = now_ns();
+
+	sim_result(r, samples, t1 - t0);
+	r->dropped = ring->dropped - dropped;
+	r->err_ppm = used ? ppm(sum / used, truth) : 0;
+	r->max_ppm = worst;
+
+	munmap(map, size);
+	close(fd);
+	return 0;
+}
+
+/*
+ * The periodic burst measurement, sampled from the measurement file twice
+ * per interval. A result with period 0 is a burst that did not see its
+ * periods before the next tick, it is counted as an overrun.
+ */
+static int run_periodic(unsigned int hz, unsigned int interval_ms, struct result *r)
+{
+	uint64_t m[4], truth, t0, t1, end, seq, first, used = 0;
+	double sum = 0, worst = 0, e;
+
+	write_u64(PARAM_DIR "gate_hz", UINT32_MAX);
+	if (write_u64(CHANNEL_DIR "interval_ms", interval_ms))
+		return -1;
+
+	truth = sim_start(hz);
+	memset(r, 0, sizeof(*r));
+
+	if (read_u64s(CHANNEL_DIR "measurement", m, 4))
+		goto err;
+	first = seq = m[3];
+	t0 = now_ns();
+	end = t0 + duration_ms * 1000000ull;
+
+	while (now_ns() < end) {
+		sleep_ms(interval_ms > 1 ? interval_ms / 2 : 1);
+		if (read_u64s(CHANNEL_DIR "measurement", m, 4))
+			goto err;
+		if (m[3] == seq)
+			continue;
+		seq = m[3];
+
+		if (!m[0]) {
+			r->overruns++;
+			continue;
+		}
+		sum += m[0];
+		used++;
+		e = ppm(m[0], truth);
+		if (fabs(e) > fabs(worst))
+			worst = e;
+	}
+	t1 = now_ns();
+
+	write_u64(CHANNEL_DIR "interval_ms", 0);
+	sim_result(r, seq - first, t1 - t0);
+	r->err_ppm = used ? ppm(sum / used, truth) : 0;
+	r->max_ppm = worst;
+	return 0;
+
+err:
+	write_u64(CHANNEL_DIR "interval_ms", 0);
+	return -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d device] [-t ms] [-i interval_ms] [-m stream|gated|periodic]\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int interval_ms = 10;
+	uint64_t sim_hz, gate_hz;
+	struct result r;
+	unsigned int i, best;
+	int mode, only = -1;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "d:t:i:m:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 't':
+			duration_ms = atoi(optarg);
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'm':
+			for (only = 0; only < 3; only++) {
+				if (!strcmp(optarg, mode_names[only]))
+					break;
+			}
+			if (only < 3)
+				break;
+			/* fall through */
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (read_u64s(PARAM_DIR "sim_hz", &sim_hz, 1) ||
+	    read_u64s(PARAM_DIR "gate_hz", &gate_hz, 1)) {
+		fprintf(stderr, "tc_capture is not loaded or not built with TC_CAPTURE_SIM\n");
+		return 1;
+	}
+
+	for (mode = MODE_STREAM; mode <= MODE_PERIODIC; mode++) {
+		if (only >= 0 && mode != only)
+			continue;
+
+		printf("\n%s\n%10s %12s %10s %10s %10s %10s %10s\n", mode_names[mode],
+		       "edge Hz", "samples/s", "overruns", "dropped", "irq ns",
+		       "err ppm", "max ppm");
+
+		best = 0;
+		for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+			if (mode == MODE_PERIODIC)
+				ret = run_periodic(rates[i], interval_ms, &r);
+			else
+				ret = run_stream(rates[i], mode == MODE_GATED, &r);
+			if (ret)
+				goto out;
+
+			printf("%10u %12.0f %10llu %10llu %10.0f %10.1f %10.1f\n",
+			       rates[i], r.samples_s, (unsigned long long)r.overruns,
+			       (unsigned long long)r.dropped, r.irq_ns, r.err_ppm, r.max_ppm);
+
+			// kept up: nothing lost and, when capturing, every period seen
+			if (!r.overruns && !r.dropped && r.samples_s > 0 &&
+			    (mode != MODE_STREAM || r.samples_s > rates[i] * 0.95))
+				best = rates[i];
+		}
+		printf("max sustainable %u Hz\n", best);
+	}
+
+out:
+	write_u64(PARAM_DIR "sim_hz", sim_hz);
+	write_u64(PARAM_DIR "gate_hz", gate_hz);
+	return ret ? 1 : 0;
+}
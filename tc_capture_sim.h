@@ -0,0 +1,567 @@
+#ifndef __TC_CAPTURE_SIM_H
+#define __TC_CAPTURE_SIM_H
+
+/*
+ * software stand-in for the TC block, to run tc_capture on a machine
+ * without a SAMA7. It is built into the module with -DTC_CAPTURE_SIM:
+ *
+ *   make -C /lib/modules/$(uname -r)/build M=$PWD obj-m=tc_capture.o \
+ *	ccflags-y=-DTC_CAPTURE_SIM modules
+ *
+ * The module then registers its own platform device. Channel 0 captures,
+ * channel 1 is its counting channel, there is no dma. Every TIOA carries
+ * the same PWM, sim_hz with sim_duty per mille high, both can be changed
+ * at run time and the signal restarts with a rising edge at the next
+ * register access.
+ *
+ * The registers are not stored but computed at each access from the time
+ * of the access: the counter from its last reset, RA/RB/TC_RAB/TC_SR from
+ * the edges since the previous access. An hrtimer fires at the edges whose
+ * loads have their interrupt enabled and calls tc_block_interrupt, as the
+ * hardware interrupt would. A late timer finds several loads and flags
+ * TC_SR_LOVRS like the hardware does, so overruns come from the real irq
+ * latency of the machine. The time spent in the handler is counted in
+ * /sys/kernel/debug/tc_capture_sim/, tc_capture_bench reads it from there.
+ */
+
+#include <linux/debugfs.h>
+
+static unsigned int sim_hz = 1000;
+module_param(sim_hz, uint, 0644);
+MODULE_PARM_DESC(sim_hz, "frequency of the simulated input, 0 none");
+
+static unsigned int sim_duty = 250;
+module_param(sim_duty, uint, 0644);
+MODULE_PARM_DESC(sim_duty, "high time of the simulated input, per mille");
+
+static unsigned int sim_clk_hz = 200000000;
+module_param(sim_clk_hz, uint, 0444);
+MODULE_PARM_DESC(sim_clk_hz, "simulated peripheral clock of the TC");
+
+#define TC_SIM_WINDOW 0x100
+
+// unread loads, in the order TC_RAB returns them
+#define TC_SIM_RA 0
+#define TC_SIM_RB 1
+
+struct tc_sim_channel {
+	u32 cmr;
+	u32 imr;
+	u32 sr;				/* since the last TC_SR read */
+	u32 ra;
+	u32 rb;
+	u32 rc;
+	bool clk_on;
+	u64 ticks;			/* counter at seg_ns */
+	u64 seg_ns;			/* last reset, start or clock change */
+	u64 wraps;			/* COVFS already flagged */
+	bool ra_armed;			/* RA loads once per trigger or RB */
+	bool rb_armed;			/* RB loads after an RA */
+	u8 rab[2];
+	u8 rab_n;
+	u32 xc_edges;			/* counting on XC, rising edges since SWTRG */
+};
+
+struct tc_sim {
+	void *window;			/* only its addresses are used */
+	spinlock_t lock;
+	struct tc_sim_channel ch[TC_MAX_CHANNELS];
+	u32 bmr;
+
+	unsigned int hz;		/* sim_hz and sim_duty the signal has */
+	unsigned int duty;
+	u64 t0;				/* a rising edge */
+	u64 period_ns;			/* 0, no signal */
+	u64 high_ns;
+	u64 done_ns;			/* edges up to here are in the registers */
+
+	struct hrtimer timer;
+	bool in_irq;
+	spinlock_t irq_lock;		/* held while the handler runs */
+	void *irq_data;
+
+	struct dentry *debugfs;
+	u64 irq_ns;
+	u64 irq_count;
+	u64 edges;
+};
+
+static struct tc_sim *tc_sim;
+
+static irqreturn_t tc_block_interrupt(int irq, void *private);
+
+static u32 tc_sim_hz(struct tc_sim_channel *c)
+{
+	u32 sel = c->cmr & TC_CMR_TCCLKS_Msk;
+
+	if (sel < ARRAY_SIZE(tc_clock_div))
+		return sim_clk_hz / tc_clock_div[sel];
+
+	return sel == TC_CMR_TCCLKS_TIMER_CLOCK5 ? 32768 : 0;
+}
+
+static bool tc_sim_xc(struct tc_sim_channel *c)
+{
+	return (c->cmr & TC_CMR_TCCLKS_Msk) >= TC_CMR_TCCLKS_XC0;
+}
+
+static u64 tc_sim_counter(struct tc_sim_channel *c, u64 t)
+{
+	if (!c->clk_on || tc_sim_xc(c))
+		return c->ticks;
+
+	return c->ticks + mul_u64_u32_div(t - c->seg_ns, tc_sim_hz(c), NSEC_PER_SEC);
+}
+
+// the counter keeps its value from t on, with the clock the cmr has then
+static void tc_sim_segment(struct tc_sim_channel *c, u64 t)
+{
+	c->ticks = tc_sim_counter(c, t);
+	c->seg_ns = t;
+}
+
+static void tc_sim_reset(struct tc_sim_channel *c, u64 t)
+{
+	c->ticks = 0;
+	c->seg_ns = t;
+	c->wraps = 0;
+	c->ra_armed = true;
+	c->rb_armed = false;
+}
+
+static void tc_sim_signal(struct tc_sim *sim, u64 now)
+{
+	unsigned int hz = READ_ONCE(sim_hz);
+	unsigned int duty = min(READ_ONCE(sim_duty), 1000u);
+
+	if (hz == sim->hz && duty == sim->duty)
+		return;
+
+	sim->hz = hz;
+	sim->duty = duty;
+	sim->period_ns = hz ? max_t(u64, div_u64(NSEC_PER_SEC, hz), 2) : 0;
+	if (sim->period_ns)
+		sim->high_ns = clamp_t(u64, div_u64(sim->period_ns * duty, 1000), 1,
+				       sim->period_ns - 1);
+	sim->t0 = now;
+	sim->done_ns = now;
+}
+
+// first edge after t, the rising ones at t0 + k * period
+static u64 tc_sim_next_edge(struct tc_sim *sim, u64 t, bool *rising)
+{
+	u64 off;
+
+	div64_u64_rem(t - sim->t0, sim->period_ns, &off);
+	if (off < sim->high_ns) {
+		*rising = false;
+		return t - off + sim->high_ns;
+	}
+
+	*rising = true;
+	return t - off + sim->period_ns;
+}
+
+// the falling edge at or before t
+static u64 tc_sim_last_fall(struct tc_sim *sim, u64 t)
+{
+	u64 off;
+
+	div64_u64_rem(t - sim->t0, sim->period_ns, &off);
+	if (off >= sim->high_ns)
+		return t - off + sim->high_ns;
+
+	return t - off - sim->period_ns + sim->high_ns;
+}
+
+static void tc_sim_load(struct tc_sim_channel *c, int reg, u32 v)
+{
+	int i;
+
+	// the previous value of the register was not read
+	for (i = 0; i < c->rab_n; i++) {
+		if (c->rab[i] == reg)
+			c->sr |= TC_SR_LOVRS;
+	}
+
+	if (reg == TC_SIM_RA) {
+		c->ra = v;
+		c->sr |= TC_SR_LDRAS;
+	} else {
+		c->rb = v;
+		c->sr |= TC_SR_LDRBS;
+	}
+
+	// a full TC_RAB keeps the newest two
+	if (c->rab_n == ARRAY_SIZE(c->rab)) {
+		c->rab[0] = c->rab[1];
+		c->rab_n--;
+	}
+	c->rab[c->rab_n++] = reg;
+}
+
+static void tc_sim_edge(struct tc_sim *sim, u64 t, bool rising)
+{
+	u32 code = rising ? 1 : 2;
+	struct tc_sim_channel *c;
+	u64 ticks;
+
+	sim->edges++;
+
+	for (c = sim->ch; c < sim->ch + TC_MAX_CHANNELS; c++) {
+		if (!c->clk_on || (c->cmr & TC_CMR_WAVE))
+			continue;
+		if (tc_sim_xc(c)) {
+			if (rising)
+				c->xc_edges++;
+			continue;
+		}
+
+		ticks = tc_sim_counter(c, t);
+		if (ticks >> 32 > c->wraps) {
+			c->wraps = ticks >> 32;
+			c->sr |= TC_SR_COVFS;
+		}
+
+		if ((((c->cmr & TC_CMR_LDRA_Msk) >> TC_CMR_LDRA_Pos) & code) && c->ra_armed) {
+			tc_sim_load(c, TC_SIM_RA, ticks);
+			c->ra_armed = false;
+			c->rb_armed = true;
+		}
+		if ((((c->cmr & TC_CMR_LDRB_Msk) >> TC_CMR_LDRB_Pos) & code) && c->rb_armed) {
+			tc_sim_load(c, TC_SIM_RB, ticks);
+			c->rb_armed = false;
+			c->ra_armed = true;
+			if (c->cmr & (TC_CMR_LDBSTOP | TC_CMR_LDBDIS)) {
+				tc_sim_segment(c, t);
+				c->clk_on = false;
+				continue;
+			}
+		}
+
+		if ((c->cmr & TC_CMR_ABETRG) &&
+		    (((c->cmr & TC_CMR_ETRGEDG_Msk) >> TC_CMR_ETRGEDG_Pos) & code))
+			tc_sim_reset(c, t);
+	}
+}
+
+/*
+ * Puts the edges up to now into the registers. Only the last periods can
+ * still be in RA/RB, older ones are skipped: a capturing channel lost them,
+ * a counting one just adds them up.
+ */
+static void tc_sim_advance(struct tc_sim *sim, u64 now)
+{
+	struct tc_sim_channel *c;
+	bool rising;
+	u64 skip, t, fall;
+
+	tc_sim_signal(sim, now);
+	if (!sim->period_ns || now <= sim->done_ns)
+		return;
+
+	skip = div64_u64(now - sim->done_ns, sim->period_ns);
+	if (skip > 2) {
+		skip -= 2;
+		sim->done_ns += skip * sim->period_ns;
+		sim->edges += 2 * skip;
+		fall = tc_sim_last_fall(sim, sim->done_ns);
+		for (c = sim->ch; c < sim->ch + TC_MAX_CHANNELS; c++) {
+			if (!c->clk_on || (c->cmr & TC_CMR_WAVE))
+				continue;
+			if (tc_sim_xc(c)) {
+				c->xc_edges += skip;
+				continue;
+			}
+			if (c->cmr & (TC_CMR_LDRA_Msk | TC_CMR_LDRB_Msk))
+				c->sr |= TC_SR_LOVRS;
+			// the counter restarted at the last falling edge skipped
+			if ((c->cmr & TC_CMR_ABETRG) &&
+			    (c->cmr & TC_CMR_ETRGEDG_Msk) == TC_CMR_ETRGEDG_FALLING &&
+			    fall > c->seg_ns)
+				tc_sim_reset(c, fall);
+		}
+	}
+
+	for (;;) {
+		t = tc_sim_next_edge(sim, sim->done_ns, &rising);
+		if (t > now)
+			break;
+		tc_sim_edge(sim, t, rising);
+		sim->done_ns = t;
+	}
+	sim->done_ns = now;
+}
+
+// when the timer has to call the handler next, 0 never
+static u64 tc_sim_next_irq(struct tc_sim *sim, u64 now)
+{
+	struct tc_sim_channel *c;
+	u64 next = 0, t, wrap;
+	bool rising, loads = false;
+	u32 hz;
+
+	for (c = sim->ch; c < sim->ch + TC_MAX_CHANNELS; c++) {
+		if (c->sr & c->imr)
+			return now;
+		if (!c->clk_on || tc_sim_xc(c))
+			continue;
+		if (c->imr & (TC_SR_LDRAS | TC_SR_LDRBS))
+			loads = true;
+		hz = tc_sim_hz(c);
+		if ((c->imr & TC_SR_COVFS) && hz) {
+			wrap = c->seg_ns + mul_u64_u32_div(((c->wraps + 1) << 32) - c->ticks,
+							   NSEC_PER_SEC, hz);
+			next = next ? min(next, wrap) : wrap;
+		}
+	}
+
+	if (loads && sim->period_ns) {
+		t = tc_sim_next_edge(sim, max(now, sim->done_ns), &rising);
+		next = next ? min(next, t) : t;
+	}
+
+	return next;
+}
+
+static enum hrtimer_restart tc_sim_timer(struct hrtimer *timer)
+{
+	struct tc_sim *sim = container_of(timer, struct tc_sim, timer);
+	struct tc_sim_channel *c;
+	bool pending = false;
+	u64 now, t, next;
+
+	spin_lock(&sim->lock);
+	tc_sim_advance(sim, ktime_get_ns());
+	for (c = sim->ch; c < sim->ch + TC_MAX_CHANNELS; c++)
+		pending |= !!(c->sr & c->imr);
+	sim->in_irq = true;
+	spin_unlock(&sim->lock);
+
+	if (pending && sim->irq_data) {
+		spin_lock(&sim->irq_lock);
+		t = ktime_get_ns();
+		tc_block_interrupt(0, sim->irq_data);
+		sim->irq_ns += ktime_get_ns() - t;
+		sim->irq_count++;
+		spin_unlock(&sim->irq_lock);
+	}
+
+	/*
+	 * re-arm under the lock like tc_sim_kick does, a kick between the
+	 * unlock and a HRTIMER_RESTART would be overwritten
+	 */
+	spin_lock(&sim->lock);
+	sim->in_irq = false;
+	now = ktime_get_ns();
+	next = tc_sim_next_irq(sim, now);
+	if (next)
+		hrtimer_start(timer, ns_to_ktime(max(next, now)), HRTIMER_MODE_ABS);
+	spin_unlock(&sim->lock);
+
+	return HRTIMER_NORESTART;
+}
+
+// after a register write, the handler re-arms the timer itself
+static void tc_sim_kick(struct tc_sim *sim, u64 now)
+{
+	u64 next;
+
+	if (sim->in_irq)
+		return;
+
+	next = tc_sim_next_irq(sim, now);
+	if (next)
+		hrtimer_start(&sim->timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+}
+
+static u32 tc_sim_read_channel(struct tc_sim_channel *c, u32 off, u64 now)
+{
+	u32 v;
+
+	switch (off) {
+	case OFFSET_TC_CMR:
+		return c->cmr;
+	case OFFSET_TC_CV:
+		return tc_sim_xc(c) ? c->xc_edges : tc_sim_counter(c, now);
+	case OFFSET_TC_RA:
+		if (c->rab_n && c->rab[0] == TC_SIM_RA)
+			c->rab[0] = c->rab[--c->rab_n];
+		return c->ra;
+	case OFFSET_TC_RB:
+		if (c->rab_n && c->rab[c->rab_n - 1] == TC_SIM_RB)
+			c->rab_n--;
+		return c->rb;
+	case OFFSET_TC_RAB:
+		if (!c->rab_n)
+			return c->rb;
+		v = c->rab[0] == TC_SIM_RA ? c->ra : c->rb;
+		c->rab[0] = c->rab[1];
+		c->rab_n--;
+		return v;
+	case OFFSET_TC_RC:
+		return c->rc;
+	case OFFSET_TC_SR:
+		v = c->sr | (c->clk_on ? TC_SR_CLKSTA : 0);
+		c->sr = 0;
+		return v;
+	case OFFSET_TC_IMR:
+		return c->imr;
+	default:
+		return 0;
+	}
+}
+
+static void tc_sim_write_channel(struct tc_sim_channel *c, u32 off, u32 v, u64 now)
+{
+	switch (off) {
+	case OFFSET_TC_CCR:
+		if (v & TC_CCR_CLKDIS) {
+			tc_sim_segment(c, now);
+			c->clk_on = false;
+		} else if (v & TC_CCR_CLKEN) {
+			c->seg_ns = now;
+			c->clk_on = true;
+		}
+		if ((v & TC_CCR_SWTRG) && c->clk_on) {
+			tc_sim_reset(c, now);
+			c->xc_edges = 0;
+		}
+		break;
+	case OFFSET_TC_CMR:
+		tc_sim_segment(c, now);
+		c->cmr = v;
+		break;
+	case OFFSET_TC_RC:
+		c->rc = v;
+		break;
+	case OFFSET_TC_IER:
+		c->imr |= v;
+		break;
+	case OFFSET_TC_IDR:
+		c->imr &= ~v;
+		break;
+	}
+}
+
+static u32 tc_sim_readl(const void *addr)
+{
+	struct tc_sim *sim = tc_sim;
+	u32 off = addr - sim->window;
+	unsigned long flags;
+	u64 now;
+	u32 v = 0;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	now = ktime_get_ns();
+	tc_sim_advance(sim, now);
+	if (off < 0x40 * TC_MAX_CHANNELS)
+		v = tc_sim_read_channel(&sim->ch[off / 0x40], off % 0x40, now);
+	else if (off == OFFSET_TC_BMR)
+		v = sim->bmr;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return v;
+}
+
+static void tc_sim_writel(u32 v, void *addr)
+{
+	struct tc_sim *sim = tc_sim;
+	u32 off = addr - sim->window;
+	unsigned long flags;
+	u64 now;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	now = ktime_get_ns();
+	tc_sim_advance(sim, now);
+	if (off < 0x40 * TC_MAX_CHANNELS)
+		tc_sim_write_channel(&sim->ch[off / 0x40], off % 0x40, v, now);
+	else if (off == OFFSET_TC_BMR)
+		sim->bmr = v;
+	tc_sim_kick(sim, now);
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+// the handler runs from the timer, not from an irq line
+static void tc_sim_synchronize(void)
+{
+	spin_lock_irq(&tc_sim->irq_lock);
+	spin_unlock_irq(&tc_sim->irq_lock);
+}
+
+// at module load, before the platform device shows up
+static int tc_sim_create(void)
+{
+	struct tc_sim *sim;
+
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
+
+	sim->window = kzalloc(TC_SIM_WINDOW, GFP_KERNEL);
+	if (!sim->window) {
+		kfree(sim);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&sim->lock);
+	spin_lock_init(&sim->irq_lock);
+	hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	sim->timer.function = tc_sim_timer;
+	sim->hz = UINT_MAX;
+
+	sim->debugfs = debugfs_create_dir("tc_capture_sim", NULL);
+	debugfs_create_u64("irq_ns", 0644, sim->debugfs, &sim->irq_ns);
+	debugfs_create_u64("irq_count", 0644, sim->debugfs, &sim->irq_count);
+	debugfs_create_u64("edges", 0644, sim->debugfs, &sim->edges);
+	debugfs_create_u64("period_ns", 0444, sim->debugfs, &sim->period_ns);
+
+	tc_sim = sim;
+	return 0;
+}
+
+static void tc_sim_destroy(void)
+{
+	struct tc_sim *sim = tc_sim;
+
+	hrtimer_cancel(&sim->timer);
+	debugfs_remove_recursive(sim->debugfs);
+	tc_sim = NULL;
+	kfree(sim->window);
+	kfree(sim);
+}
+
+// the register window of the probe, the timer calls its handler from now on
+static void __iomem *tc_sim_attach(struct capture_data *ddata)
+{
+	spin_lock_irq(&tc_sim->lock);
+	tc_sim->irq_data = ddata;
+	spin_unlock_irq(&tc_sim->lock);
+
+	return (void __iomem *)tc_sim->window;
+}
+
+static void tc_sim_detach(void)
+{
+	spin_lock_irq(&tc_sim->lock);
+	tc_sim->irq_data = NULL;
+	spin_unlock_irq(&tc_sim->lock);
+	hrtimer_cancel(&tc_sim->timer);
+}
+
+// no device tree: channel 0 captures, channel 1 counts for it
+static void tc_sim_parse(struct capture_data *ddata)
+{
+	if (ddata->channels == BIT(0) && ddata->ch[0].gate_id < 0)
+		ddata->ch[0].gate_id = 1;
+	ddata->nr_irqs = 1;
+	ddata->irq[0] = 0;
+}
+
+#undef readl
+#undef writel
+#define readl(addr) tc_sim_readl((const void *)(addr))
+#define writel(v, addr) tc_sim_writel((v), (void *)(addr))
+#define synchronize_irq(irq) ((void)(irq), tc_sim_synchronize())
+
+#endif